@@ -21,11 +21,14 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <strings.h>
 
 #include "libacm.h"
 
@@ -35,6 +38,8 @@ static int cf_raw = 0;
 static int cf_force_chans = 0;
 static int cf_no_output = 0;
 static int cf_quiet = 0;
+static int cf_pipeline = 0;
+static int cf_threads = 1;
 
 static void show_header(const char *fn, ACMStream *acm)
 {
@@ -107,6 +112,8 @@ static void play_file(const char *fn)
 		fprintf(stderr, "%s: %s\n", fn, acm_strerror(err));
 		return;
 	}
+	if (cf_pipeline)
+		acm_set_pipeline(acm, 1);
 	show_header(fn, acm);
 
 	memset(&fmt, 0, sizeof fmt);
@@ -228,19 +235,56 @@ static int write_wav_header(FILE *f, ACMStream *acm)
 		return 0;
 }
 
+/*
+ * Decode whole file at once with several threads.  returns 0 if done,
+ * -1 if file must be decoded sequentially (not in memory, too big).
+ */
+static int decode_parallel(ACMStream *acm, const char *fn, const char *fn2, FILE *fo,
+			   unsigned long long total_bytes, unsigned long long *bytes_done)
+{
+	size_t len = total_bytes;
+	char *buf;
+	int res;
+
+	if (len != total_bytes || len == 0)
+		return -1;
+	buf = malloc(len);
+	if (buf == NULL)
+		return -1;
+
+	res = acm_decode_parallel(acm, buf, acm_pcm_total(acm), 0,2,1, cf_threads);
+	if (res == ACM_ERR_NOT_SEEKABLE) {
+		free(buf);
+		return -1;
+	}
+	if (res < 0) {
+		fprintf(stderr, "%s: %s\n", fn, acm_strerror(res));
+		res = 0;
+	}
+
+	len = (size_t)res * acm_channels(acm) * ACM_WORD;
+	if (!cf_no_output && fwrite(buf, 1, len, fo) != len)
+		fprintf(stderr, "%s: write error\n", fn2);
+	*bytes_done = len;
+	free(buf);
+	return 0;
+}
+
 static void decode_file(const char *fn, const char *fn2)
 {
 	ACMStream *acm;
 	char *buf;
-	int res, res2, buflen, err;
+	int res, res2, buflen, err, parallel = 0;
 	FILE *fo = NULL;
-	int bytes_done = 0, total_bytes;
+	unsigned long long bytes_done = 0, total_bytes;
 
 	err = acm_open_file(&acm, fn, cf_force_chans);
 	if (err < 0) {
 		fprintf(stderr, "%s: %s\n", fn, acm_strerror(err));
 		return;
 	}
+	if (cf_pipeline)
+		acm_set_pipeline(acm, 1);
 
 	if (!cf_no_output) {
 		if (!strcmp(fn2, "-")) {
@@ -269,9 +313,13 @@ static void decode_file(const char *fn, const char *fn2)
 	buflen = 16*1024;
 	buf = malloc(buflen);
 
-	total_bytes = acm_pcm_total(acm) * acm_channels(acm) * ACM_WORD;
-	
-	while (bytes_done < total_bytes) {
+	total_bytes = (unsigned long long)acm_pcm_total(acm) * acm_channels(acm) * ACM_WORD;
+
+	/* sequential reading if parallel decoding is not possible */
+	if (cf_threads > 1)
+		parallel = decode_parallel(acm, fn, fn2, fo, total_bytes, &bytes_done) == 0;
+
+	while (!parallel && bytes_done < total_bytes) {
 		res = acm_read_loop(acm, buf, buflen/2, 0,2,1);
 		if (res == 0)
 			break;
@@ -292,7 +340,7 @@ static void decode_file(const char *fn, const char *fn2)
 
 	memset(buf, 0, buflen);
 	if (bytes_done < total_bytes)
-		fprintf(stderr, "%s: adding filler_samples: %d\n",
+		fprintf(stderr, "%s: adding filler_samples: %llu\n",
 			fn, total_bytes - bytes_done);
 	while (bytes_done < total_bytes) {
 		int bs;
@@ -361,6 +409,106 @@ static void set_channels(const char *fn, int n_chan)
 	fclose(f);
 }
 
+/*
+ * Seek index files
+ */
+
+static void index_file(const char *fn)
+{
+	ACMStream *acm;
+	char *idxfn;
+	int err;
+
+	err = acm_open_file(&acm, fn, cf_force_chans);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", fn, acm_strerror(err));
+		return;
+	}
+
+	/* valid index was loaded on open */
+	if (acm->index != NULL) {
+		if (!cf_quiet)
+			printf("%s: up to date\n", fn);
+		acm_close(acm);
+		return;
+	}
+
+	idxfn = malloc(strlen(fn) + strlen(ACM_INDEX_SUFFIX) + 1);
+	strcpy(idxfn, fn);
+	strcat(idxfn, ACM_INDEX_SUFFIX);
+
+	err = acm_index_build(acm, 0);
+	if (err == ACM_OK)
+		err = acm_index_save(acm, idxfn);
+	if (err < 0)
+		fprintf(stderr, "%s: %s\n", fn, acm_strerror(err));
+	else if (!cf_quiet)
+		printf("%s: indexed\n", fn);
+
+	free(idxfn);
+	acm_close(acm);
+}
+
+/* parse file without decoding, check that it is complete */
+static void check_file(const char *fn)
+{
+	ACMStream *acm;
+	unsigned frames;
+	int err;
+
+	err = acm_open_file(&acm, fn, cf_force_chans);
+	if (err < 0) {
+		printf("%s: %s\n", fn, acm_strerror(err));
+		return;
+	}
+	err = acm_scan(acm, &frames);
+	if (err < 0)
+		printf("%s: %s, %u of %u samples\n", fn, acm_strerror(err),
+		       frames, acm_pcm_total(acm));
+	else if (!cf_quiet)
+		printf("%s: OK\n", fn);
+	acm_close(acm);
+}
+
+static int is_acm_name(const char *fn)
+{
+	unsigned len = strlen(fn);
+	return len > 4 && strcasecmp(fn + len - 4, ".acm") == 0;
+}
+
+/* files given on command line are indexed, directories are scanned for *.acm */
+static void index_path(const char *path, int top)
+{
+	struct stat st;
+	struct dirent *de;
+	DIR *dir;
+	char *fn;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		if (top || (S_ISREG(st.st_mode) && is_acm_name(path)))
+			index_file(path);
+		return;
+	}
+
+	if ((dir = opendir(path)) == NULL) {
+		perror(path);
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		fn = malloc(strlen(path) + strlen(de->d_name) + 2);
+		sprintf(fn, "%s/%s", path, de->d_name);
+		index_path(fn, 0);
+		free(fn);
+	}
+	closedir(dir);
+}
+
 /*
  * Just show info
  */
@@ -383,23 +531,30 @@ static void show_info(const char *fn)
 static void usage(int err)
 {
 	printf("%s\n", version);
-	printf("Play:   acmtool -p [-q][-m|-s] acmfile [acmfile ...]\n");
-	printf("Decode: acmtool -d [-q][-m|-s] [-r|-n] -o wavfile acmfile\n");
-	printf("        acmtool -d [-q][-m|-s] [-r|-n] acmfile [acmfile ...]\n");
+	printf("Play:   acmtool -p [-q][-m|-s][-P] acmfile [acmfile ...]\n");
+	printf("Decode: acmtool -d [-q][-m|-s] [-r|-n][-c][-P|-j N] -o wavfile acmfile\n");
+	printf("        acmtool -d [-q][-m|-s] [-r|-n][-c][-P|-j N] acmfile [acmfile ...]\n");
 	printf("Other:  acmtool -i acmfile [acmfile ...]\n");
 	printf("        acmtool -M|-S acmfile [acmfile ...]\n");
+	printf("        acmtool -x [-q] acmfile|dir [acmfile|dir ...]\n");
+	printf("        acmtool -t [-q] acmfile [acmfile ...]\n");
 	printf("Commands:\n");
 	printf("  -p     play file(s)\n");
 	printf("  -d     decode audio into WAV files\n");
 	printf("  -i     show info about ACM files\n");
 	printf("  -M     modify ACM header to have 1 channel\n");
 	printf("  -S     modify ACM header to have 2 channels\n");
+	printf("  -x     write seek index files, directories are scanned for *.acm\n");
+	printf("  -t     check that files are complete, without decoding\n");
 	printf("Switches:\n");
 	printf("  -m     force mono\n");
 	printf("  -s     force stereo (default)\n");
 	printf("  -r     raw output - no wav header\n");
 	printf("  -q     be quiet\n");
 	printf("  -n     no output - for benchmarking\n");
+	printf("  -c     use plain C code instead of SIMD - for testing\n");
+	printf("  -P     decode in two threads\n");
+	printf("  -j N   decode file with N threads\n");
 	printf("  -o FN  output to file, can be used if single source file\n");
 	exit(err);
 }
@@ -410,10 +565,10 @@ int main(int argc, char *argv[])
 	char *fn, *fn2 = NULL;
 	int cmd_decode = 0;
 	int cmd_chg_channels = 0;
-	int cmd_info = 0, cmd_play = 0;
+	int cmd_info = 0, cmd_play = 0, cmd_index = 0, cmd_check = 0;
 	int cf_set_chans = 0;
 
-	while ((c = getopt(argc, argv, "pdiMSqhrmsnvo:")) != -1) {
+	while ((c = getopt(argc, argv, "pdiMSxtqhrmsncPj:vo:")) != -1) {
 		switch (c) {
 		case 'h':
 			usage(0);
@@ -435,6 +590,12 @@ int main(int argc, char *argv[])
 			cmd_chg_channels = 1;
 			cf_set_chans = 2;
 			break;
+		case 'x':
+			cmd_index = 1;
+			break;
+		case 't':
+			cmd_check = 1;
+			break;
 		case 'q':
 			cf_quiet = 1;
 			break;
@@ -450,6 +611,15 @@ int main(int argc, char *argv[])
 		case 'n':
 			cf_no_output = 1;
 			break;
+		case 'c':
+			acm_set_simd(ACM_SIMD_NONE);
+			break;
+		case 'P':
+			cf_pipeline = 1;
+			break;
+		case 'j':
+			cf_threads = atoi(optarg);
+			break;
 		case 'o':
 			fn2 = optarg;
 			break;
@@ -461,7 +631,8 @@ int main(int argc, char *argv[])
 			usage(1);
 		}
 	}
-	i = cmd_chg_channels + cmd_info + cmd_decode + cmd_play;
+	i = cmd_chg_channels + cmd_info + cmd_decode + cmd_play + cmd_index
+		+ cmd_check;
 	if (i < 1 || i > 1) {
 		fprintf(stderr, "only one command at a time please\n");
 		usage(1);
@@ -489,6 +660,20 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 	
+	/* check files */
+	if (cmd_check) {
+		for (i = optind; i < argc; i++)
+			check_file(argv[i]);
+		return 0;
+	}
+
+	/* seek index files */
+	if (cmd_index) {
+		for (i = optind; i < argc; i++)
+			index_path(argv[i], 1);
+		return 0;
+	}
+
 	/* channel changing */
 	if (cmd_chg_channels) {
 		for (i = optind; i < argc; i++)
@@ -23,14 +23,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* AVX2 code falls back to SSE2 code for narrow blocks */
+#if defined(HAVE_TARGET_AVX2) && defined(__SSE2__)
+#define USE_AVX2
+#include <immintrin.h>
+#endif
 
 #include "libacm.h"
+#include "resample.h"
+#include "index.h"
+#include "pipeline.h"
 
 #define ACM_BUFLEN	(64*1024)
 
 #define ACM_EXPECTED_EOF -99
 
+/* fillers write this many columns into colbuf before it is copied to block */
+#define TILE_COLS	16
+
 typedef int (*filler_t)(ACMStream *acm, unsigned ind, unsigned col);
+typedef void (*juggle_t)(int *wrap_p, int *block_p, unsigned sub_len, unsigned sub_count);
+typedef void (*juggle_tail_t)(int *wrap_p, int *block_p, unsigned len);
+
+/* output format for decoding directly into caller buffer */
+struct OutArgs {
+	unsigned char *dst;
+	int bigendianp, wordlen, sgned;
+};
+
+static int convert_values(ACMStream *acm, int *src, unsigned char *dst, unsigned n,
+		int bigendianp, int wordlen, int sgned);
+
+/* SIMD level for new streams, ACM_SIMD_AUTO means not detected yet */
+static int simd_default = ACM_SIMD_AUTO;
 
 /**************************************
  * Stream processing
@@ -38,6 +73,24 @@ typedef int (*filler_t)(ACMStream *acm, unsigned ind, unsigned col);
 
 /* NB: bits <= 31!  Thus less checks in code. */
 
+/*
+ * The bit reservoir is 64 bits wide, bits above bit_avail are always zero.
+ * Reload happens when less than requested bits are available, so there
+ * is always room for at least 4 new bytes.
+ */
+
+static inline unsigned long long get_le64(const unsigned char *p)
+{
+	return (unsigned long long)p[0]
+		| ((unsigned long long)p[1] << 8)
+		| ((unsigned long long)p[2] << 16)
+		| ((unsigned long long)p[3] << 24)
+		| ((unsigned long long)p[4] << 32)
+		| ((unsigned long long)p[5] << 40)
+		| ((unsigned long long)p[6] << 48)
+		| ((unsigned long long)p[7] << 56);
+}
+
 static int load_buf(ACMStream *acm)
 {
 	int res = 0;
@@ -66,72 +119,105 @@ static int load_buf(ACMStream *acm)
 	return 0;
 }
 
-static int load_bits(ACMStream *acm)
+/* slow path: fill bytewise, crossing buffer boundaries */
+static int load_bits(ACMStream *acm, unsigned bits)
 {
 	int err;
-	unsigned data, got;
-	unsigned char *p = acm->buf + acm->buf_pos;
-	switch (acm->buf_size - acm->buf_pos) {
-	default:
-		data = 0;
-		got = 0;
-		break;
-	case 1:
-		data = p[0];
-		got = 8;
-		break;
-	case 2:
-		data = p[0] + (p[1] << 8);
-		got = 16;
-		break;
-	case 3:
-		data = p[0] + (p[1] << 8) + (p[2] << 16);
-		got = 24;
-		break;
-	}
-	
-	if ((err = load_buf(acm)) < 0)
-		return err;
-	
-	while (got < 32) {
-		if (acm->buf_size - acm->buf_pos == 0)
-			break;
-		data |= acm->buf[acm->buf_pos] << got;
-		got += 8;
-		acm->buf_pos++;
+	while (acm->bit_avail < bits) {
+		if (acm->buf_pos >= acm->buf_size) {
+			if (acm->file_eof)
+				return ACM_ERR_UNEXPECTED_EOF;
+			if (acm->mem_data) {
+				/* single zero byte after data */
+				acm->file_eof = 1;
+				acm->bit_avail += 8;
+				continue;
+			}
+			if ((err = load_buf(acm)) < 0)
+				return err;
+			continue;
+		}
+		acm->bit_data |= (unsigned long long)acm->buf[acm->buf_pos++]
+				<< acm->bit_avail;
+		acm->bit_avail += 8;
 	}
-	acm->bit_data = data;
-	acm->bit_avail = got;
 	return 0;
 }
 
+/* refill with single load, buffer must have at least 8 bytes left */
+static inline void load_bits64(ACMStream *acm)
+{
+	/* take as many whole bytes as fit */
+	unsigned n = (64 - acm->bit_avail) >> 3;
+	acm->bit_data |= (get_le64(acm->buf + acm->buf_pos)
+			& (~0ULL >> (64 - n*8))) << acm->bit_avail;
+	acm->buf_pos += n;
+	acm->bit_avail += n*8;
+}
+
+/* make at least "bits" bits available, if stream has them */
+static int fill_bits(ACMStream *acm, unsigned bits)
+{
+	if (acm->buf_size - acm->buf_pos >= 8) {
+		load_bits64(acm);
+		return 0;
+	}
+	return load_bits(acm, bits);
+}
+
 static int get_bits_reload(ACMStream *acm, unsigned bits)
 {
-	int got, err;
-	unsigned data, b_data, b_avail;
+	int err;
+	unsigned data;
 
-	data = acm->bit_data;
-	got = acm->bit_avail;
-	bits -= got;
+	if ((err = fill_bits(acm, bits)) < 0)
+		return err;
 
-	if (acm->buf_size - acm->buf_pos >= 4) {
-		unsigned char *p = acm->buf + acm->buf_pos;
-		acm->buf_pos += 4;
-		b_data = p[0] + (p[1] << 8) + (p[2] << 16) + (p[3] << 24);
-		b_avail = 32;
-	} else	{
-		if ((err = load_bits(acm)) < 0)
-			return err;
-		if (acm->bit_avail < bits)
+	data = acm->bit_data & ((1 << bits) - 1);
+	acm->bit_data >>= bits;
+	acm->bit_avail -= bits;
+	return data;
+}
+
+unsigned long long acm_tell_bits(ACMStream *acm)
+{
+	/* buf_pos is absolute for in-memory data, buf_start_ofs is 0 */
+	return (unsigned long long)(acm->buf_start_ofs + acm->buf_pos) * 8 - acm->bit_avail;
+}
+
+int acm_seek_bits(ACMStream *acm, unsigned long long bit_ofs)
+{
+	unsigned ofs = bit_ofs >> 3, skip = bit_ofs & 7;
+	int err;
+
+	/* read-ahead is not needed anymore */
+	if (acm->pipe)
+		acm_pipe_stop(acm, 1);
+
+	if (acm->mem_data) {
+		if (ofs > acm->buf_size)
 			return ACM_ERR_UNEXPECTED_EOF;
-		b_data = acm->bit_data;
-		b_avail = acm->bit_avail;
+		acm->buf_pos = ofs;
+	} else {
+		if (acm->io.seek_func == NULL)
+			return ACM_ERR_NOT_SEEKABLE;
+		if (acm->io.seek_func(acm->io_arg, ofs, SEEK_SET) < 0)
+			return ACM_ERR_NOT_SEEKABLE;
+		acm->buf_pos = 0;
+		acm->buf_size = 0;
+		acm->buf_start_ofs = ofs;
 	}
-	
-	data |= (b_data & ((1 << bits) - 1)) << got;
-	acm->bit_data = b_data >> bits;
-	acm->bit_avail = b_avail - bits;
-	return data;
+	acm->file_eof = 0;
+	acm->bit_avail = 0;
+	acm->bit_data = 0;
+
+	if (skip > 0) {
+		if ((err = fill_bits(acm, skip)) < 0)
+			return err;
+		acm->bit_data >>= skip;
+		acm->bit_avail -= skip;
+	}
+	return 0;
 }
 
 #define GET_BITS_NOERR(tmpval, acm, bits) do { \
@@ -162,22 +248,186 @@ static int get_bits_reload(ACMStream *acm, unsigned bits)
 		res = tmpval; \
 	} while (0)
 
+/*
+ * Bit access for fillers.  In fast mode the caller has checked
+ * that buffer contains whole column, so there is no need
+ * to check for buffer end or errors.
+ */
+
+/* peek at next bits without consuming, missing bits at EOF are zero */
+#define PEEK_BITS(res, acm, bits, fast) do { \
+		if (acm->bit_avail < bits) { \
+			if (fast) { \
+				load_bits64(acm); \
+			} else { \
+				int tmperr = fill_bits(acm, bits); \
+				if (tmperr < 0 && tmperr != ACM_ERR_UNEXPECTED_EOF) \
+					return tmperr; \
+			} \
+		} \
+		res = acm->bit_data & ((1 << bits) - 1); \
+	} while (0)
+
+/* consume bits after PEEK_BITS */
+#define SKIP_BITS(acm, bits, fast) do { \
+		if (!fast && acm->bit_avail < bits) \
+			return ACM_ERR_UNEXPECTED_EOF; \
+		acm->bit_data >>= bits; \
+		acm->bit_avail -= bits; \
+	} while (0)
+
 /*************************************************
  * Table filling
  *************************************************/
-static const int map_1bit[] = { -1, +1 };
-static const int map_2bit_near[] = { -2, -1, +1, +2 };
-static const int map_2bit_far[] = { -3, -2, +2, +3 };
-static const int map_3bit[] = { -4, -3, -2, -1, +1, +2, +3, +4 };
 
-/* IOW: (r * acm->subblock_len) + c */
+/*
+ * Prefix codes for k-fillers, indexed with next bits from stream.
+ * Entry gives code length, number of rows it fills and value.
+ * Rows > 1 are zero-runs.
+ */
+struct kcode {
+	unsigned char len;
+	unsigned char rows;
+	signed char val;
+};
+
+static const struct kcode tab_k13[1 << 3] = {
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {3,1,-1}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {3,1,+1}
+};
+static const struct kcode tab_k12[1 << 2] = {
+	{1,1, 0}, {2,1,-1}, {1,1, 0}, {2,1,+1}
+};
+static const struct kcode tab_k24[1 << 4] = {
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,-2}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,-1},
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,+1}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,+2}
+};
+static const struct kcode tab_k23[1 << 3] = {
+	{1,1, 0}, {3,1,-2}, {1,1, 0}, {3,1,-1}, {1,1, 0}, {3,1,+1}, {1,1, 0}, {3,1,+2}
+};
+static const struct kcode tab_k35[1 << 5] = {
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,-1}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,-3},
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,+1}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,-2},
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,-1}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,+2},
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {4,1,+1}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,+3}
+};
+static const struct kcode tab_k34[1 << 4] = {
+	{1,1, 0}, {3,1,-1}, {1,1, 0}, {4,1,-3}, {1,1, 0}, {3,1,+1}, {1,1, 0}, {4,1,-2},
+	{1,1, 0}, {3,1,-1}, {1,1, 0}, {4,1,+2}, {1,1, 0}, {3,1,+1}, {1,1, 0}, {4,1,+3}
+};
+static const struct kcode tab_k45[1 << 5] = {
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,-4}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,-3},
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,-2}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,-1},
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,+1}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,+2},
+	{1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,+3}, {1,2, 0}, {2,1, 0}, {1,2, 0}, {5,1,+4}
+};
+static const struct kcode tab_k44[1 << 4] = {
+	{1,1, 0}, {4,1,-4}, {1,1, 0}, {4,1,-3}, {1,1, 0}, {4,1,-2}, {1,1, 0}, {4,1,-1},
+	{1,1, 0}, {4,1,+1}, {1,1, 0}, {4,1,+2}, {1,1, 0}, {4,1,+3}, {1,1, 0}, {4,1,+4}
+};
+
+/*
+ * Packed values for t-fillers, indexed with code.  Each code
+ * holds 3 (t15, t27) or 2 (t37) values, codes past the
+ * last valid combination are marked with ok = 0.
+ */
+struct tcode {
+	signed char val[3];
+	unsigned char ok;
+};
+
+static const struct tcode tab_t15[1 << 5] = {
+	{{-1,-1,-1}, 1}, {{ 0,-1,-1}, 1}, {{ 1,-1,-1}, 1}, {{-1, 0,-1}, 1},
+	{{ 0, 0,-1}, 1}, {{ 1, 0,-1}, 1}, {{-1, 1,-1}, 1}, {{ 0, 1,-1}, 1},
+	{{ 1, 1,-1}, 1}, {{-1,-1, 0}, 1}, {{ 0,-1, 0}, 1}, {{ 1,-1, 0}, 1},
+	{{-1, 0, 0}, 1}, {{ 0, 0, 0}, 1}, {{ 1, 0, 0}, 1}, {{-1, 1, 0}, 1},
+	{{ 0, 1, 0}, 1}, {{ 1, 1, 0}, 1}, {{-1,-1, 1}, 1}, {{ 0,-1, 1}, 1},
+	{{ 1,-1, 1}, 1}, {{-1, 0, 1}, 1}, {{ 0, 0, 1}, 1}, {{ 1, 0, 1}, 1},
+	{{-1, 1, 1}, 1}, {{ 0, 1, 1}, 1}, {{ 1, 1, 1}, 1}, {{ 0, 0, 0}, 0},
+	{{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}
+};
+static const struct tcode tab_t27[1 << 7] = {
+	{{-2,-2,-2}, 1}, {{-1,-2,-2}, 1}, {{ 0,-2,-2}, 1}, {{ 1,-2,-2}, 1},
+	{{ 2,-2,-2}, 1}, {{-2,-1,-2}, 1}, {{-1,-1,-2}, 1}, {{ 0,-1,-2}, 1},
+	{{ 1,-1,-2}, 1}, {{ 2,-1,-2}, 1}, {{-2, 0,-2}, 1}, {{-1, 0,-2}, 1},
+	{{ 0, 0,-2}, 1}, {{ 1, 0,-2}, 1}, {{ 2, 0,-2}, 1}, {{-2, 1,-2}, 1},
+	{{-1, 1,-2}, 1}, {{ 0, 1,-2}, 1}, {{ 1, 1,-2}, 1}, {{ 2, 1,-2}, 1},
+	{{-2, 2,-2}, 1}, {{-1, 2,-2}, 1}, {{ 0, 2,-2}, 1}, {{ 1, 2,-2}, 1},
+	{{ 2, 2,-2}, 1}, {{-2,-2,-1}, 1}, {{-1,-2,-1}, 1}, {{ 0,-2,-1}, 1},
+	{{ 1,-2,-1}, 1}, {{ 2,-2,-1}, 1}, {{-2,-1,-1}, 1}, {{-1,-1,-1}, 1},
+	{{ 0,-1,-1}, 1}, {{ 1,-1,-1}, 1}, {{ 2,-1,-1}, 1}, {{-2, 0,-1}, 1},
+	{{-1, 0,-1}, 1}, {{ 0, 0,-1}, 1}, {{ 1, 0,-1}, 1}, {{ 2, 0,-1}, 1},
+	{{-2, 1,-1}, 1}, {{-1, 1,-1}, 1}, {{ 0, 1,-1}, 1}, {{ 1, 1,-1}, 1},
+	{{ 2, 1,-1}, 1}, {{-2, 2,-1}, 1}, {{-1, 2,-1}, 1}, {{ 0, 2,-1}, 1},
+	{{ 1, 2,-1}, 1}, {{ 2, 2,-1}, 1}, {{-2,-2, 0}, 1}, {{-1,-2, 0}, 1},
+	{{ 0,-2, 0}, 1}, {{ 1,-2, 0}, 1}, {{ 2,-2, 0}, 1}, {{-2,-1, 0}, 1},
+	{{-1,-1, 0}, 1}, {{ 0,-1, 0}, 1}, {{ 1,-1, 0}, 1}, {{ 2,-1, 0}, 1},
+	{{-2, 0, 0}, 1}, {{-1, 0, 0}, 1}, {{ 0, 0, 0}, 1}, {{ 1, 0, 0}, 1},
+	{{ 2, 0, 0}, 1}, {{-2, 1, 0}, 1}, {{-1, 1, 0}, 1}, {{ 0, 1, 0}, 1},
+	{{ 1, 1, 0}, 1}, {{ 2, 1, 0}, 1}, {{-2, 2, 0}, 1}, {{-1, 2, 0}, 1},
+	{{ 0, 2, 0}, 1}, {{ 1, 2, 0}, 1}, {{ 2, 2, 0}, 1}, {{-2,-2, 1}, 1},
+	{{-1,-2, 1}, 1}, {{ 0,-2, 1}, 1}, {{ 1,-2, 1}, 1}, {{ 2,-2, 1}, 1},
+	{{-2,-1, 1}, 1}, {{-1,-1, 1}, 1}, {{ 0,-1, 1}, 1}, {{ 1,-1, 1}, 1},
+	{{ 2,-1, 1}, 1}, {{-2, 0, 1}, 1}, {{-1, 0, 1}, 1}, {{ 0, 0, 1}, 1},
+	{{ 1, 0, 1}, 1}, {{ 2, 0, 1}, 1}, {{-2, 1, 1}, 1}, {{-1, 1, 1}, 1},
+	{{ 0, 1, 1}, 1}, {{ 1, 1, 1}, 1}, {{ 2, 1, 1}, 1}, {{-2, 2, 1}, 1},
+	{{-1, 2, 1}, 1}, {{ 0, 2, 1}, 1}, {{ 1, 2, 1}, 1}, {{ 2, 2, 1}, 1},
+	{{-2,-2, 2}, 1}, {{-1,-2, 2}, 1}, {{ 0,-2, 2}, 1}, {{ 1,-2, 2}, 1},
+	{{ 2,-2, 2}, 1}, {{-2,-1, 2}, 1}, {{-1,-1, 2}, 1}, {{ 0,-1, 2}, 1},
+	{{ 1,-1, 2}, 1}, {{ 2,-1, 2}, 1}, {{-2, 0, 2}, 1}, {{-1, 0, 2}, 1},
+	{{ 0, 0, 2}, 1}, {{ 1, 0, 2}, 1}, {{ 2, 0, 2}, 1}, {{-2, 1, 2}, 1},
+	{{-1, 1, 2}, 1}, {{ 0, 1, 2}, 1}, {{ 1, 1, 2}, 1}, {{ 2, 1, 2}, 1},
+	{{-2, 2, 2}, 1}, {{-1, 2, 2}, 1}, {{ 0, 2, 2}, 1}, {{ 1, 2, 2}, 1},
+	{{ 2, 2, 2}, 1}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}
+};
+static const struct tcode tab_t37[1 << 7] = {
+	{{-5,-5, 0}, 1}, {{-4,-5, 0}, 1}, {{-3,-5, 0}, 1}, {{-2,-5, 0}, 1},
+	{{-1,-5, 0}, 1}, {{ 0,-5, 0}, 1}, {{ 1,-5, 0}, 1}, {{ 2,-5, 0}, 1},
+	{{ 3,-5, 0}, 1}, {{ 4,-5, 0}, 1}, {{ 5,-5, 0}, 1}, {{-5,-4, 0}, 1},
+	{{-4,-4, 0}, 1}, {{-3,-4, 0}, 1}, {{-2,-4, 0}, 1}, {{-1,-4, 0}, 1},
+	{{ 0,-4, 0}, 1}, {{ 1,-4, 0}, 1}, {{ 2,-4, 0}, 1}, {{ 3,-4, 0}, 1},
+	{{ 4,-4, 0}, 1}, {{ 5,-4, 0}, 1}, {{-5,-3, 0}, 1}, {{-4,-3, 0}, 1},
+	{{-3,-3, 0}, 1}, {{-2,-3, 0}, 1}, {{-1,-3, 0}, 1}, {{ 0,-3, 0}, 1},
+	{{ 1,-3, 0}, 1}, {{ 2,-3, 0}, 1}, {{ 3,-3, 0}, 1}, {{ 4,-3, 0}, 1},
+	{{ 5,-3, 0}, 1}, {{-5,-2, 0}, 1}, {{-4,-2, 0}, 1}, {{-3,-2, 0}, 1},
+	{{-2,-2, 0}, 1}, {{-1,-2, 0}, 1}, {{ 0,-2, 0}, 1}, {{ 1,-2, 0}, 1},
+	{{ 2,-2, 0}, 1}, {{ 3,-2, 0}, 1}, {{ 4,-2, 0}, 1}, {{ 5,-2, 0}, 1},
+	{{-5,-1, 0}, 1}, {{-4,-1, 0}, 1}, {{-3,-1, 0}, 1}, {{-2,-1, 0}, 1},
+	{{-1,-1, 0}, 1}, {{ 0,-1, 0}, 1}, {{ 1,-1, 0}, 1}, {{ 2,-1, 0}, 1},
+	{{ 3,-1, 0}, 1}, {{ 4,-1, 0}, 1}, {{ 5,-1, 0}, 1}, {{-5, 0, 0}, 1},
+	{{-4, 0, 0}, 1}, {{-3, 0, 0}, 1}, {{-2, 0, 0}, 1}, {{-1, 0, 0}, 1},
+	{{ 0, 0, 0}, 1}, {{ 1, 0, 0}, 1}, {{ 2, 0, 0}, 1}, {{ 3, 0, 0}, 1},
+	{{ 4, 0, 0}, 1}, {{ 5, 0, 0}, 1}, {{-5, 1, 0}, 1}, {{-4, 1, 0}, 1},
+	{{-3, 1, 0}, 1}, {{-2, 1, 0}, 1}, {{-1, 1, 0}, 1}, {{ 0, 1, 0}, 1},
+	{{ 1, 1, 0}, 1}, {{ 2, 1, 0}, 1}, {{ 3, 1, 0}, 1}, {{ 4, 1, 0}, 1},
+	{{ 5, 1, 0}, 1}, {{-5, 2, 0}, 1}, {{-4, 2, 0}, 1}, {{-3, 2, 0}, 1},
+	{{-2, 2, 0}, 1}, {{-1, 2, 0}, 1}, {{ 0, 2, 0}, 1}, {{ 1, 2, 0}, 1},
+	{{ 2, 2, 0}, 1}, {{ 3, 2, 0}, 1}, {{ 4, 2, 0}, 1}, {{ 5, 2, 0}, 1},
+	{{-5, 3, 0}, 1}, {{-4, 3, 0}, 1}, {{-3, 3, 0}, 1}, {{-2, 3, 0}, 1},
+	{{-1, 3, 0}, 1}, {{ 0, 3, 0}, 1}, {{ 1, 3, 0}, 1}, {{ 2, 3, 0}, 1},
+	{{ 3, 3, 0}, 1}, {{ 4, 3, 0}, 1}, {{ 5, 3, 0}, 1}, {{-5, 4, 0}, 1},
+	{{-4, 4, 0}, 1}, {{-3, 4, 0}, 1}, {{-2, 4, 0}, 1}, {{-1, 4, 0}, 1},
+	{{ 0, 4, 0}, 1}, {{ 1, 4, 0}, 1}, {{ 2, 4, 0}, 1}, {{ 3, 4, 0}, 1},
+	{{ 4, 4, 0}, 1}, {{ 5, 4, 0}, 1}, {{-5, 5, 0}, 1}, {{-4, 5, 0}, 1},
+	{{-3, 5, 0}, 1}, {{-2, 5, 0}, 1}, {{-1, 5, 0}, 1}, {{ 0, 5, 0}, 1},
+	{{ 1, 5, 0}, 1}, {{ 2, 5, 0}, 1}, {{ 3, 5, 0}, 1}, {{ 4, 5, 0}, 1},
+	{{ 5, 5, 0}, 1}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0},
+	{{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}, {{ 0, 0, 0}, 0}
+};
+
+/* columns are stored contiguously in colbuf, see flush_cols() */
 #define set_pos(acm, r, c, idx) do { \
-		unsigned _pos = ((r) << acm->info.acm_level) + (c); \
-		acm->block[_pos] = acm->midbuf[idx]; \
+		unsigned _pos = ((c) & (TILE_COLS - 1)) * acm->info.acm_rows + (r); \
+		acm->colbuf[_pos] = (unsigned)(idx) * acm->block_amp; \
 	} while (0)
 
 /************ Fillers **********/
 
+/*
+ * Fillers are written as inline functions with "fast" and "scan"
+ * arguments, checked and fast variants are generated from them below.
+ * Scan variants only consume bits, without storing values.
+ */
+
 static int f_zero(ACMStream *acm, unsigned ind, unsigned col)
 {
 	unsigned i;
@@ -187,294 +437,265 @@ static int f_zero(ACMStream *acm, unsigned ind, unsigned col)
 	return 1;
 }
 
+static int s_zero(ACMStream *acm, unsigned ind, unsigned col)
+{
+	return 1;
+}
+
 static int f_bad(ACMStream *acm, unsigned ind, unsigned col)
 {
 	/* corrupt block? */
 	return ACM_ERR_CORRUPT;
 }
 
-static int f_linear(ACMStream *acm, unsigned ind, unsigned col)
+#ifdef USE_AVX2
+
+/*
+ * Unpack linear fields 8 at a time into column "dst".  8 fields take
+ * "ind" bytes, so byte offsets and shifts repeat for every group.
+ * Needs 24 bytes readable from start of each group.
+ *
+ * returns number of rows done
+ */
+__attribute__((target("avx2")))
+static unsigned linear_avx2(ACMStream *acm, unsigned ind, int *dst)
 {
-	unsigned int i;
-	int b, middle = 1 << (ind - 1);
+	unsigned long long pos = (unsigned long long)acm->buf_pos * 8 - acm->bit_avail;
+	const unsigned char *q = acm->buf + (pos >> 3);
+	unsigned rows = acm->info.acm_rows, half, i, j, k, t;
+	unsigned char ctl[32];
+	int shift[8];
+	__m128i c0, c1, lo, hi;
+	__m256i x, vshift, mask, middle, amp;
+
+	if (rows < 8)
+		return 0;
 
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, ind);
-		set_pos(acm, i, col, b - middle);
+	/* fields 0..3 are loaded from q, 4..7 from q + half */
+	half = ((pos & 7) + 4*ind) >> 3;
+	for (j = 0; j < 8; j++) {
+		t = (j < 4 ? pos & 7 : ((pos & 7) + 4*ind) & 7) + (j & 3) * ind;
+		shift[j] = t & 7;
+		for (k = 0; k < 4; k++)
+			ctl[j*4 + k] = (t >> 3) + k;
 	}
-	return 1;
-}
-
-static int f_k13(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i++, col, 0);
-			if (i >= acm->info.acm_rows)
-				break;
-			set_pos(acm, i, col, 0);
-			continue;
-		}
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 1, 0 */
-			set_pos(acm, i, col, 0);
-			continue;
-		}
-		/* 1, 1, ? */
-		GET_BITS(b, acm, 1);
-		set_pos(acm, i, col, map_1bit[b]);
+	c0 = _mm_loadu_si128((__m128i *)ctl);
+	c1 = _mm_loadu_si128((__m128i *)(ctl + 16));
+	vshift = _mm256_loadu_si256((__m256i *)shift);
+	mask = _mm256_set1_epi32((1 << ind) - 1);
+	middle = _mm256_set1_epi32(1 << (ind - 1));
+	amp = _mm256_set1_epi32(acm->block_amp);
+
+	for (i = 0; i + 8 <= rows; i += 8) {
+		lo = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)q), c0);
+		hi = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(q + half)), c1);
+		x = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		x = _mm256_and_si256(_mm256_srlv_epi32(x, vshift), mask);
+		x = _mm256_mullo_epi32(_mm256_sub_epi32(x, middle), amp);
+		_mm256_storeu_si256((__m256i *)(dst + i), x);
+		q += ind;
 	}
-	return 1;
-}
 
-static int f_k12(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i, col, 0);
-			continue;
-		}
-		
-		/* 1, ? */
-		GET_BITS(b, acm, 1);
-		set_pos(acm, i, col, map_1bit[b]);
+	/* continue reading after unpacked fields */
+	pos += (unsigned long long)i * ind;
+	acm->buf_pos = pos >> 3;
+	acm->bit_data = 0;
+	acm->bit_avail = 0;
+	if (pos & 7) {
+		load_bits64(acm);
+		acm->bit_data >>= pos & 7;
+		acm->bit_avail -= pos & 7;
 	}
-	return 1;
+	return i;
 }
 
-static int f_k24(ACMStream *acm, unsigned ind, unsigned col)
+#endif /* USE_AVX2 */
+
+static inline int do_linear(ACMStream *acm, unsigned ind, unsigned col, int fast, int scan)
 {
-	unsigned i, b;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i++, col, 0);
-			if (i >= acm->info.acm_rows) break;
-			set_pos(acm, i, col, 0);
-			continue;
+	unsigned int i, j, b, n, per;
+	int middle = 1 << (ind - 1);
+	unsigned long long data;
+
+	if (fast && scan) {
+		/* column has fixed length, whole bytes are skipped in buffer */
+		n = acm->info.acm_rows * ind;
+		if (n < acm->bit_avail) {
+			acm->bit_data >>= n;
+			acm->bit_avail -= n;
+			return 1;
 		}
-		
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 1, 0 */
-			set_pos(acm, i, col, 0);
-			continue;
+		n -= acm->bit_avail;
+		acm->buf_pos += n >> 3;
+		acm->bit_data = 0;
+		acm->bit_avail = 0;
+		if (n & 7) {
+			load_bits64(acm);
+			acm->bit_data >>= n & 7;
+			acm->bit_avail -= n & 7;
 		}
-		
-		/* 1, 1, ?, ? */
-		GET_BITS(b, acm, 2);
-		set_pos(acm, i, col, map_2bit_near[b]);
+		return 1;
 	}
-	return 1;
-}
 
-static int f_k23(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i, col, 0);
-			continue;
+	if (fast) {
+		/*
+		 * Refill gives at least 57 bits, so several fields
+		 * can be taken from the reservoir without checks.
+		 */
+		per = 57 / ind;
+		i = 0;
+#ifdef USE_AVX2
+		if (acm->simd >= ACM_SIMD_AVX2)
+			i = linear_avx2(acm, ind, acm->colbuf
+					+ (col & (TILE_COLS - 1)) * acm->info.acm_rows);
+#endif
+		for (; i < acm->info.acm_rows; i += n) {
+			n = acm->info.acm_rows - i;
+			if (n > per)
+				n = per;
+			if (acm->bit_avail < n * ind)
+				load_bits64(acm);
+			data = acm->bit_data;
+			for (j = 0; j < n; j++) {
+				b = data & ((1 << ind) - 1);
+				data >>= ind;
+				set_pos(acm, i + j, col, (int)b - middle);
+			}
+			acm->bit_data = data;
+			acm->bit_avail -= n * ind;
 		}
-
-		/* 1, ?, ? */
-		GET_BITS(b, acm, 2);
-		set_pos(acm, i, col, map_2bit_near[b]);
+		return 1;
 	}
-	return 1;
-}
 
-static int f_k35(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
 	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i++, col, 0);
-			if (i >= acm->info.acm_rows)
-				break;
-			set_pos(acm, i, col, 0);
-			continue;
-		}
-		
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 1, 0 */
-			set_pos(acm, i, col, 0);
-			continue;
-		}
-		
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 1, 1, 0, ? */
-			GET_BITS(b, acm, 1);
-			set_pos(acm, i, col, map_1bit[b]);
-			continue;
-		}
-		
-		/* 1, 1, 1, ?, ? */
-		GET_BITS(b, acm, 2);
-		set_pos(acm, i, col, map_2bit_far[b]);
+		PEEK_BITS(b, acm, ind, 0);
+		SKIP_BITS(acm, ind, 0);
+		if (!scan)
+			set_pos(acm, i, col, (int)b - middle);
 	}
 	return 1;
 }
 
-static int f_k34(ACMStream *acm, unsigned ind, unsigned col)
+/*
+ * Decode a column of prefix codes.  The row after current one
+ * is always zeroed, for single-row codes next code overwrites it.
+ */
+static inline int do_kcode(ACMStream *acm, unsigned col,
+			   const struct kcode *tbl, unsigned nbits, int fast, int scan)
 {
-	unsigned i, b;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i, col, 0);
-			continue;
+	const struct kcode *e;
+	unsigned i = 0, b;
+
+	while (i + 1 < acm->info.acm_rows) {
+		PEEK_BITS(b, acm, nbits, fast);
+		e = &tbl[b];
+		SKIP_BITS(acm, e->len, fast);
+		if (!scan) {
+			set_pos(acm, i, col, e->val);
+			set_pos(acm, i + 1, col, 0);
 		}
-		
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 1, 0, ? */
-			GET_BITS(b, acm, 1);
-			set_pos(acm, i, col, map_1bit[b]);
-			continue;
-		}
-		
-		/* 1, 1, ?, ? */
-		GET_BITS(b, acm, 2);
-		set_pos(acm, i, col, map_2bit_far[b]);
+		i += e->rows;
 	}
-	return 1;
-}
-
-static int f_k45(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i, col, 0); i++;
-			if (i >= acm->info.acm_rows)
-				break;
-			set_pos(acm, i, col, 0);
-			continue;
-		} 
-		
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 1, 0 */
-			set_pos(acm, i, col, 0);
-			continue;
-		}
-		
-		/* 1, 1, ?, ?, ? */
-		GET_BITS(b, acm, 3);
-		set_pos(acm, i, col, map_3bit[b]);
+	if (i < acm->info.acm_rows) {
+		PEEK_BITS(b, acm, nbits, fast);
+		e = &tbl[b];
+		SKIP_BITS(acm, e->len, fast);
+		if (!scan)
+			set_pos(acm, i, col, e->val);
 	}
 	return 1;
 }
 
-static int f_k44(ACMStream *acm, unsigned ind, unsigned col)
+/* Decode a column of codes packing "nvals" values each */
+static inline int do_tcode(ACMStream *acm, unsigned col, const struct tcode *tbl,
+			   unsigned nbits, unsigned nvals, int fast, int scan)
 {
-	unsigned i, b;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		GET_BITS(b, acm, 1);
-		if (b == 0) {
-			/* 0 */
-			set_pos(acm, i, col, 0);
+	const struct tcode *e;
+	unsigned i = 0, j, b;
+
+	while (i < acm->info.acm_rows) {
+		PEEK_BITS(b, acm, nbits, fast);
+		SKIP_BITS(acm, nbits, fast);
+		e = &tbl[b];
+		if (!e->ok)
+			return ACM_ERR_CORRUPT;
+		if (scan) {
+			i += nvals;
 			continue;
 		}
-		
-		/* 1, ?, ?, ? */
-		GET_BITS(b, acm, 3);
-		set_pos(acm, i, col, map_3bit[b]);
+		for (j = 0; j < nvals && i < acm->info.acm_rows; j++)
+			set_pos(acm, i++, col, e->val[j]);
 	}
 	return 1;
 }
 
-static int f_t15(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
-	int n1, n2, n3, tmp;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		/* b = (x1) + (x2 * 3) + (x3 * 9) */
-		GET_BITS(b, acm, 5);
-		if (b >= 3 * 3 * 3)
-			return ACM_ERR_CORRUPT;
-
-		n1 = b % 3 - 1;
-		tmp = b / 3;
-		n2 = tmp % 3 - 1;
-		n3 = tmp / 3 - 1;
-
-		set_pos(acm, i++, col, n1);
-		if (i >= acm->info.acm_rows)
-			break;
-		set_pos(acm, i++, col, n2);
-		if (i >= acm->info.acm_rows)
-			break;
-		set_pos(acm, i, col, n3);
-	}
-	return 1;
+#define DEF_FILLER(name, call) \
+static int f_##name(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return call(acm, ind, col, 0, 0); \
+} \
+static int f_##name##_fast(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return call(acm, ind, col, 1, 0); \
+} \
+static int s_##name(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return call(acm, ind, col, 0, 1); \
+} \
+static int s_##name##_fast(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return call(acm, ind, col, 1, 1); \
 }
 
-static int f_t27(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
-	int n1, n2, n3, tmp;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		/* b = (x1) + (x2 * 5) + (x3 * 25) */
-		GET_BITS(b, acm, 7);
-		if (b >= 5 * 5 * 5)
-			return ACM_ERR_CORRUPT;
-
-		n1 = b % 5 - 2;
-		tmp = b / 5;
-		n2 = tmp % 5 - 2;
-		n3 = tmp / 5 - 2;
-
-		set_pos(acm, i++, col, n1);
-		if (i >= acm->info.acm_rows)
-			break;
-		set_pos(acm, i++, col, n2);
-		if (i >= acm->info.acm_rows)
-			break;
-		set_pos(acm, i, col, n3);
-	}
-	return 1;
+#define DEF_KFILLER(name, nbits) \
+static int f_##name(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_kcode(acm, col, tab_##name, nbits, 0, 0); \
+} \
+static int f_##name##_fast(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_kcode(acm, col, tab_##name, nbits, 1, 0); \
+} \
+static int s_##name(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_kcode(acm, col, tab_##name, nbits, 0, 1); \
+} \
+static int s_##name##_fast(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_kcode(acm, col, tab_##name, nbits, 1, 1); \
 }
 
-static int f_t37(ACMStream *acm, unsigned ind, unsigned col)
-{
-	unsigned i, b;
-	int n1, n2;
-	for (i = 0; i < acm->info.acm_rows; i++) {
-		/* b = (x1) + (x2 * 11) */
-		GET_BITS(b, acm, 7);
-		if (b >= 11 * 11)
-			return ACM_ERR_CORRUPT;
-
-		n1 = b % 11 - 5;
-		n2 = b / 11 - 5;
-
-		set_pos(acm, i++, col, n1);
-		if (i >= acm->info.acm_rows)
-			break;
-		set_pos(acm, i, col, n2);
-	}
-	return 1;
+#define DEF_TFILLER(name, nbits, nvals) \
+static int f_##name(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_tcode(acm, col, tab_##name, nbits, nvals, 0, 0); \
+} \
+static int f_##name##_fast(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_tcode(acm, col, tab_##name, nbits, nvals, 1, 0); \
+} \
+static int s_##name(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_tcode(acm, col, tab_##name, nbits, nvals, 0, 1); \
+} \
+static int s_##name##_fast(ACMStream *acm, unsigned ind, unsigned col) \
+{ \
+	return do_tcode(acm, col, tab_##name, nbits, nvals, 1, 1); \
 }
 
+DEF_FILLER(linear, do_linear)
+DEF_KFILLER(k13, 3)
+DEF_KFILLER(k12, 2)
+DEF_KFILLER(k24, 4)
+DEF_KFILLER(k23, 3)
+DEF_KFILLER(k35, 5)
+DEF_KFILLER(k34, 4)
+DEF_KFILLER(k45, 5)
+DEF_KFILLER(k44, 4)
+DEF_TFILLER(t15, 5, 3)
+DEF_TFILLER(t27, 7, 3)
+DEF_TFILLER(t37, 7, 2)
+
 /****************/
 
 static const filler_t filler_list[] = {
@@ -488,15 +709,129 @@ static const filler_t filler_list[] = {
 	f_bad, f_t37, f_bad, f_bad		/* 28..31 */
 };
 
-static int fill_block(ACMStream *acm)
+static const filler_t filler_fast_list[] = {
+	f_zero, f_bad, f_bad, f_linear_fast,			/* 0..3 */
+	f_linear_fast, f_linear_fast, f_linear_fast, f_linear_fast,	/* 4..7 */
+	f_linear_fast, f_linear_fast, f_linear_fast, f_linear_fast,	/* 8..11 */
+	f_linear_fast, f_linear_fast, f_linear_fast, f_linear_fast,	/* 12..15 */
+	f_linear_fast, f_k13_fast, f_k12_fast, f_t15_fast,	/* 16..19 */
+	f_k24_fast, f_k23_fast, f_t27_fast, f_k35_fast,		/* 20..23 */
+	f_k34_fast, f_bad, f_k45_fast, f_k44_fast,		/* 24..27 */
+	f_bad, f_t37_fast, f_bad, f_bad				/* 28..31 */
+};
+
+static const filler_t scan_list[] = {
+	s_zero, f_bad, f_bad, s_linear,		/* 0..3 */
+	s_linear, s_linear, s_linear, s_linear,	/* 4..7 */
+	s_linear, s_linear, s_linear, s_linear,	/* 8..11 */
+	s_linear, s_linear, s_linear, s_linear,	/* 12..15 */
+	s_linear, s_k13, s_k12, s_t15,		/* 16..19 */
+	s_k24, s_k23, s_t27, s_k35,		/* 20..23 */
+	s_k34, f_bad, s_k45, s_k44,		/* 24..27 */
+	f_bad, s_t37, f_bad, f_bad		/* 28..31 */
+};
+
+static const filler_t scan_fast_list[] = {
+	s_zero, f_bad, f_bad, s_linear_fast,			/* 0..3 */
+	s_linear_fast, s_linear_fast, s_linear_fast, s_linear_fast,	/* 4..7 */
+	s_linear_fast, s_linear_fast, s_linear_fast, s_linear_fast,	/* 8..11 */
+	s_linear_fast, s_linear_fast, s_linear_fast, s_linear_fast,	/* 12..15 */
+	s_linear_fast, s_k13_fast, s_k12_fast, s_t15_fast,	/* 16..19 */
+	s_k24_fast, s_k23_fast, s_t27_fast, s_k35_fast,		/* 20..23 */
+	s_k34_fast, f_bad, s_k45_fast, s_k44_fast,		/* 24..27 */
+	f_bad, s_t37_fast, f_bad, f_bad				/* 28..31 */
+};
+
+/* longest code in bits and number of rows it fills */
+static const unsigned char code_bits[] = {
+	0, 0, 0, 3,		/* 0..3 */
+	4, 5, 6, 7,		/* 4..7 */
+	8, 9, 10, 11,		/* 8..11 */
+	12, 13, 14, 15,		/* 12..15 */
+	16, 3, 2, 5,		/* 16..19 */
+	4, 3, 7, 5,		/* 20..23 */
+	4, 0, 5, 4,		/* 24..27 */
+	0, 7, 0, 0		/* 28..31 */
+};
+static const unsigned char code_rows[] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0..15 */
+	1, 1, 1, 3, 1, 1, 3, 1, 1, 1, 1, 1, 1, 2, 1, 1	/* 16..31 */
+};
+
+/*
+ * Calculate how many buffered bytes are needed to decode
+ * a column without checks.  Extra 32 bytes are for
+ * reservoir lookahead, 8-byte loads and SIMD loads.
+ */
+static void calc_fast_len(ACMStream *acm)
+{
+	unsigned ind, rows = acm->info.acm_rows, bits;
+	for (ind = 0; ind < 32; ind++) {
+		bits = (rows + code_rows[ind] - 1) / code_rows[ind] * code_bits[ind];
+		acm->fast_len[ind] = (bits >> 3) + 32;
+	}
+}
+
+/*
+ * Transpose filled columns from colbuf into row-major block,
+ * in 4x4 pieces if possible.
+ */
+static void flush_cols(ACMStream *acm, int *block, unsigned col0, unsigned ncols)
+{
+	unsigned rows = acm->info.acm_rows, cols = acm->info.acm_cols;
+	const int *src = acm->colbuf;
+	int *dst = block + col0;
+	unsigned r = 0, c;
+
+#ifdef __SSE2__
+	if (ncols % 4 == 0) {
+		for (; r + 4 <= rows; r += 4) {
+			for (c = 0; c < ncols; c += 4) {
+				const int *s = src + c * rows + r;
+				int *d = dst + r * cols + c;
+				__m128i a0, a1, a2, a3, t0, t1, t2, t3;
+
+				a0 = _mm_loadu_si128((const __m128i *)s);
+				a1 = _mm_loadu_si128((const __m128i *)(s + rows));
+				a2 = _mm_loadu_si128((const __m128i *)(s + 2*rows));
+				a3 = _mm_loadu_si128((const __m128i *)(s + 3*rows));
+				t0 = _mm_unpacklo_epi32(a0, a1);
+				t1 = _mm_unpacklo_epi32(a2, a3);
+				t2 = _mm_unpackhi_epi32(a0, a1);
+				t3 = _mm_unpackhi_epi32(a2, a3);
+				_mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi64(t0, t1));
+				_mm_storeu_si128((__m128i *)(d + cols), _mm_unpackhi_epi64(t0, t1));
+				_mm_storeu_si128((__m128i *)(d + 2*cols), _mm_unpacklo_epi64(t2, t3));
+				_mm_storeu_si128((__m128i *)(d + 3*cols), _mm_unpackhi_epi64(t2, t3));
+			}
+		}
+	}
+#endif
+	for (; r < rows; r++) {
+		for (c = 0; c < ncols; c++)
+			dst[r * cols + c] = src[c * rows + r];
+	}
+}
+
+/* with "scan", block is only parsed and values are not stored */
+static int fill_block(ACMStream *acm, int *block, int scan)
 {
-	unsigned i, ind;
+	const filler_t *list = scan ? scan_list : filler_list;
+	const filler_t *fast_list = scan ? scan_fast_list : filler_fast_list;
+	unsigned i, ind, tile;
 	int err;
+
+	tile = acm->info.acm_cols < TILE_COLS ? acm->info.acm_cols : TILE_COLS;
 	for (i = 0; i < acm->info.acm_cols; i++) {
 		GET_BITS_EXPECT_EOF(ind, acm, 5);
-		err = filler_list[ind](acm, ind, i);
+		if (acm->buf_size - acm->buf_pos >= acm->fast_len[ind])
+			err = fast_list[ind](acm, ind, i);
+		else
+			err = list[ind](acm, ind, i);
 		if (err < 0)
 			return err;
+		if (!scan && ((i + 1) & (tile - 1)) == 0)
+			flush_cols(acm, block, i + 1 - tile, tile);
 	}
 	return 1;
 }
@@ -525,38 +860,270 @@ static void juggle(int *wrap_p, int *block_p, unsigned sub_len, unsigned sub_cou
 	}
 }
 
-static void juggle_block(ACMStream *acm)
+#ifdef __SSE2__
+
+/*
+ * SIMD variants process several columns at once,
+ * column i of juggle() is in lane i of vectors.
+ */
+
+#define JUGGLE_ODD(r0, r1, r2, op) \
+	op##_add_epi32(op##_slli_epi32(r1, 1), op##_add_epi32(r0, r2))
+#define JUGGLE_EVEN(r1, r2, r3, op) \
+	op##_sub_epi32(op##_slli_epi32(r2, 1), op##_add_epi32(r1, r3))
+
+static void juggle_sse2(int *wrap_p, int *block_p, unsigned sub_len, unsigned sub_count)
 {
-	unsigned sub_count, sub_len, todo_count, step_subcount, i;
-	int *wrap_p, *block_p, *p;
-	
-	/* juggle only if subblock_len > 1 */
-	if (acm->info.acm_level == 0)
+	unsigned int i, j;
+	int *p;
+	__m128i r0, r1, r2, r3, x0, x1;
+
+	/* sub_len is power of 2 */
+	if (sub_len < 2) {
+		juggle(wrap_p, block_p, sub_len, sub_count);
 		return;
+	}
 
-	/* 2048 / subblock_len */
-	if (acm->info.acm_level > 9)
-		step_subcount = 1;
-	else
-		step_subcount = (2048 >> acm->info.acm_level) - 2;
+	if (sub_len == 2) {
+		/* use low half of vectors */
+		x0 = _mm_loadu_si128((__m128i *)wrap_p);
+		x0 = _mm_shuffle_epi32(x0, _MM_SHUFFLE(3, 1, 2, 0));
+		r0 = x0;
+		r1 = _mm_unpackhi_epi64(x0, x0);
+		p = block_p;
+		for (j = 0; j < sub_count/2; j++) {
+			r2 = _mm_loadl_epi64((__m128i *)p);
+			_mm_storel_epi64((__m128i *)p, JUGGLE_ODD(r0, r1, r2, _mm));
+			p += 2;
+			r3 = _mm_loadl_epi64((__m128i *)p);
+			_mm_storel_epi64((__m128i *)p, JUGGLE_EVEN(r1, r2, r3, _mm));
+			p += 2;
+			r0 = r2;  r1 = r3;
+		}
+		_mm_storeu_si128((__m128i *)wrap_p, _mm_unpacklo_epi32(r0, r1));
+		return;
+	}
 
-	/* Apply juggle()  (rows)x(cols)
-	 * from (step_subcount * 2)            x (subblock_len/2)
-	 * to   (step_subcount * subblock_len) x (1)
-	 */
-	todo_count = acm->info.acm_rows;
-	block_p = acm->block;
-	while (1) {
-		wrap_p = acm->wrapbuf;
-		sub_count = step_subcount;
-		if (sub_count > todo_count)
-			sub_count = todo_count;
+	for (i = 0; i < sub_len; i += 4) {
+		/* wrap_p has r0, r1 pairs, split them */
+		x0 = _mm_loadu_si128((__m128i *)wrap_p);
+		x1 = _mm_loadu_si128((__m128i *)(wrap_p + 4));
+		x0 = _mm_shuffle_epi32(x0, _MM_SHUFFLE(3, 1, 2, 0));
+		x1 = _mm_shuffle_epi32(x1, _MM_SHUFFLE(3, 1, 2, 0));
+		r0 = _mm_unpacklo_epi64(x0, x1);
+		r1 = _mm_unpackhi_epi64(x0, x1);
 
-		sub_len = acm->info.acm_cols / 2;
-		sub_count *= 2;
-		
-		juggle(wrap_p, block_p, sub_len, sub_count);
-		wrap_p += sub_len*2;
+		p = block_p + i;
+		for (j = 0; j < sub_count/2; j++) {
+			r2 = _mm_loadu_si128((__m128i *)p);
+			_mm_storeu_si128((__m128i *)p, JUGGLE_ODD(r0, r1, r2, _mm));
+			p += sub_len;
+			r3 = _mm_loadu_si128((__m128i *)p);
+			_mm_storeu_si128((__m128i *)p, JUGGLE_EVEN(r1, r2, r3, _mm));
+			p += sub_len;
+			r0 = r2;  r1 = r3;
+		}
+
+		_mm_storeu_si128((__m128i *)wrap_p, _mm_unpacklo_epi32(r0, r1));
+		_mm_storeu_si128((__m128i *)(wrap_p + 4), _mm_unpackhi_epi32(r0, r1));
+		wrap_p += 8;
+	}
+}
+
+/*
+ * Each juggle() output depends only on inputs of the same column:
+ *
+ *   even rows: out = in[-2] + 2*in[-1] + in[0]
+ *   odd rows:  out = 2*in[-1] - in[-2] - in[0]
+ *
+ * so the last levels can be calculated in one pass over data,
+ * keeping previous inputs of each level in registers.
+ */
+static inline __m128i juggle_step(__m128i cur, __m128i prev1, __m128i prev2, __m128i odd)
+{
+	__m128i s = _mm_add_epi32(cur, prev2);
+	s = _mm_sub_epi32(_mm_xor_si128(s, odd), odd);
+	return _mm_add_epi32(_mm_slli_epi32(prev1, 1), s);
+}
+
+/* shift in "n" ints from end of "prev", in front of "cur" */
+#define SHIFT_IN(cur, prev, n) \
+	_mm_or_si128(_mm_slli_si128(cur, 4*(n)), _mm_srli_si128(prev, 16 - 4*(n)))
+
+/*
+ * Levels with sub_len 4, 2 and 1, len is number of
+ * values in block and must be multiple of 8.
+ */
+static void juggle_tail_sse2(int *wrap_p, int *block_p, unsigned len)
+{
+	unsigned int i;
+	int *p = block_p;
+	__m128i h1, h2, q, t, v0, v1, y0, y1, z0, z1;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi32(-1);
+	const __m128i odd2 = _mm_set_epi32(-1, -1, 0, 0);
+	const __m128i odd1 = _mm_set_epi32(-1, 0, -1, 0);
+
+	/* sub_len 4: previous rows, one vector per row */
+	v0 = _mm_loadu_si128((__m128i *)wrap_p);
+	v1 = _mm_loadu_si128((__m128i *)(wrap_p + 4));
+	v0 = _mm_shuffle_epi32(v0, _MM_SHUFFLE(3, 1, 2, 0));
+	v1 = _mm_shuffle_epi32(v1, _MM_SHUFFLE(3, 1, 2, 0));
+	h2 = _mm_unpacklo_epi64(v0, v1);
+	h1 = _mm_unpackhi_epi64(v0, v1);
+	/* sub_len 2: previous 4 values */
+	q = _mm_loadu_si128((__m128i *)(wrap_p + 8));
+	q = _mm_shuffle_epi32(q, _MM_SHUFFLE(3, 1, 2, 0));
+	/* sub_len 1: previous 2 values, in upper half */
+	t = _mm_slli_si128(_mm_loadl_epi64((__m128i *)(wrap_p + 12)), 8);
+
+	for (i = 0; i < len; i += 8) {
+		v0 = _mm_loadu_si128((__m128i *)(p + i));
+		v1 = _mm_loadu_si128((__m128i *)(p + i + 4));
+
+		y0 = juggle_step(v0, h1, h2, zero);
+		y1 = juggle_step(v1, v0, h1, ones);
+		h2 = v0;  h1 = v1;
+
+		z0 = juggle_step(y0, SHIFT_IN(y0, q, 2), q, odd2);
+		z1 = juggle_step(y1, SHIFT_IN(y1, y0, 2), y0, odd2);
+		q = y1;
+
+		v0 = juggle_step(z0, SHIFT_IN(z0, t, 1), SHIFT_IN(z0, t, 2), odd1);
+		v1 = juggle_step(z1, SHIFT_IN(z1, z0, 1), SHIFT_IN(z1, z0, 2), odd1);
+		t = z1;
+
+		_mm_storeu_si128((__m128i *)(p + i), v0);
+		_mm_storeu_si128((__m128i *)(p + i + 4), v1);
+	}
+
+	_mm_storeu_si128((__m128i *)wrap_p, _mm_unpacklo_epi32(h2, h1));
+	_mm_storeu_si128((__m128i *)(wrap_p + 4), _mm_unpackhi_epi32(h2, h1));
+	_mm_storeu_si128((__m128i *)(wrap_p + 8), _mm_shuffle_epi32(q, _MM_SHUFFLE(3, 1, 2, 0)));
+	_mm_storel_epi64((__m128i *)(wrap_p + 12), _mm_srli_si128(t, 8));
+}
+
+#endif /* __SSE2__ */
+
+#ifdef USE_AVX2
+
+__attribute__((target("avx2")))
+static void juggle_avx2(int *wrap_p, int *block_p, unsigned sub_len, unsigned sub_count)
+{
+	unsigned int i, j;
+	int *p;
+	__m256i r0, r1, r2, r3, x0, x1;
+	const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	const __m256i merge = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	if (sub_len < 8) {
+		juggle_sse2(wrap_p, block_p, sub_len, sub_count);
+		return;
+	}
+
+	for (i = 0; i < sub_len; i += 8) {
+		x0 = _mm256_loadu_si256((__m256i *)wrap_p);
+		x1 = _mm256_loadu_si256((__m256i *)(wrap_p + 8));
+		x0 = _mm256_permutevar8x32_epi32(x0, split);
+		x1 = _mm256_permutevar8x32_epi32(x1, split);
+		r0 = _mm256_permute2x128_si256(x0, x1, 0x20);
+		r1 = _mm256_permute2x128_si256(x0, x1, 0x31);
+
+		p = block_p + i;
+		for (j = 0; j < sub_count/2; j++) {
+			r2 = _mm256_loadu_si256((__m256i *)p);
+			_mm256_storeu_si256((__m256i *)p, JUGGLE_ODD(r0, r1, r2, _mm256));
+			p += sub_len;
+			r3 = _mm256_loadu_si256((__m256i *)p);
+			_mm256_storeu_si256((__m256i *)p, JUGGLE_EVEN(r1, r2, r3, _mm256));
+			p += sub_len;
+			r0 = r2;  r1 = r3;
+		}
+
+		x0 = _mm256_permute2x128_si256(r0, r1, 0x20);
+		x1 = _mm256_permute2x128_si256(r0, r1, 0x31);
+		_mm256_storeu_si256((__m256i *)wrap_p, _mm256_permutevar8x32_epi32(x0, merge));
+		_mm256_storeu_si256((__m256i *)(wrap_p + 8), _mm256_permutevar8x32_epi32(x1, merge));
+		wrap_p += 16;
+	}
+}
+
+#endif /* USE_AVX2 */
+
+/* fused last levels, NULL if not available */
+static juggle_tail_t get_juggle_tail(int simd)
+{
+#ifdef __SSE2__
+	if (simd >= ACM_SIMD_SSE2)
+		return juggle_tail_sse2;
+#endif
+	return NULL;
+}
+
+static juggle_t get_juggle(int simd)
+{
+	switch (simd) {
+#ifdef USE_AVX2
+	case ACM_SIMD_AVX2:
+		return juggle_avx2;
+#endif
+#ifdef __SSE2__
+	case ACM_SIMD_SSE2:
+		return juggle_sse2;
+#endif
+	default:
+		return juggle;
+	}
+}
+
+/* converts finished part of block, if "out" is given */
+static inline void flush_strip(ACMStream *acm, struct OutArgs *out, int *src, unsigned n)
+{
+	if (out != NULL)
+		out->dst += convert_values(acm, src, out->dst, n,
+					   out->bigendianp, out->wordlen, out->sgned);
+}
+
+/*
+ * If "out" is given, each strip is converted into caller
+ * buffer as soon as it is ready, while it is still in cache.
+ */
+static void juggle_block(ACMStream *acm, struct OutArgs *out)
+{
+	unsigned sub_count, sub_len, todo_count, step_subcount, i;
+	int *wrap_p, *block_p, *p;
+	juggle_t juggle_fn = get_juggle(acm->simd);
+	juggle_tail_t tail_fn = get_juggle_tail(acm->simd);
+	
+	/* juggle only if subblock_len > 1 */
+	if (acm->info.acm_level == 0) {
+		flush_strip(acm, out, acm->block, acm->block_len);
+		return;
+	}
+
+	/* 2048 / subblock_len */
+	if (acm->info.acm_level > 9)
+		step_subcount = 1;
+	else
+		step_subcount = (2048 >> acm->info.acm_level) - 2;
+
+	/* Apply juggle()  (rows)x(cols)
+	 * from (step_subcount * 2)            x (subblock_len/2)
+	 * to   (step_subcount * subblock_len) x (1)
+	 */
+	todo_count = acm->info.acm_rows;
+	block_p = acm->block;
+	while (1) {
+		wrap_p = acm->wrapbuf;
+		sub_count = step_subcount;
+		if (sub_count > todo_count)
+			sub_count = todo_count;
+
+		sub_len = acm->info.acm_cols / 2;
+		sub_count *= 2;
+		
+		juggle_fn(wrap_p, block_p, sub_len, sub_count);
+		wrap_p += sub_len*2;
 		
 		for (i = 0, p = block_p; i < sub_count; i++) {
 			p[0]++;
@@ -564,52 +1131,101 @@ static void juggle_block(ACMStream *acm)
 		}
 		
 		while (sub_len > 1) {
+			if (sub_len == 8 && tail_fn) {
+				/* rest of levels in one pass */
+				tail_fn(wrap_p, block_p, sub_len * sub_count);
+				break;
+			}
 			sub_len /= 2;
 			sub_count *= 2;
-			juggle(wrap_p, block_p, sub_len, sub_count);
+			juggle_fn(wrap_p, block_p, sub_len, sub_count);
 			wrap_p += sub_len*2;
 		}
-		if (todo_count <= step_subcount)
+		if (todo_count <= step_subcount) {
+			flush_strip(acm, out, block_p, todo_count << acm->info.acm_level);
 			break;
+		}
+		flush_strip(acm, out, block_p, step_subcount << acm->info.acm_level);
 		todo_count -= step_subcount;
 		block_p += step_subcount << acm->info.acm_level;
 	}
 }
 
 /***************************************************************/
-static int decode_block(ACMStream *acm)
+
+/* read block header and values, returns 1, 0 on EOF or ACM_ERR_* */
+int acm_read_block(ACMStream *acm, int *block)
+{
+	int res;
+	unsigned hdr;
+
+	/*
+	 * read header: pwr (4 bits), val (16 bits)
+	 *
+	 * Sample is value index multiplied with val, so no table
+	 * is needed.  pwr gives the range of indexes, it is not used.
+	 */
+	GET_BITS_NOERR(res, acm, 20);
+	if (res < 0)
+		return res == ACM_ERR_UNEXPECTED_EOF ? 0 : res;
+	hdr = res;
+	acm->block_amp = hdr >> 4;
+
+	res = fill_block(acm, block, 0);
+	return res == ACM_EXPECTED_EOF ? 0 : res;
+}
+
+/* if "out" is given, block is also converted into it */
+static int decode_block(ACMStream *acm, struct OutArgs *out)
 {
-	int pwr, count, val, i, x, err;
+	unsigned long long bit_ofs = ~0ULL;
+	int err;
 
 	acm->block_ready = 0;
 	acm->block_pos = 0;
 
-	/* read header */
-	GET_BITS_EXPECT_EOF(pwr, acm, 4);
-	GET_BITS_EXPECT_EOF(val, acm, 16);
-
-	/* generate tables */
-	count = 1 << pwr;
-	for (i = 0, x = 0; i < count; i++) {
-		acm->midbuf[i] = x;
-		x += val;
-	}
-	for (i = 1, x = -val; i <= count; i++) {
-		acm->midbuf[-i] = (unsigned)x;
-		x -= val;
+	/* values come from pipeline thread or are read here */
+	if (acm->pipe) {
+		err = acm_pipe_next(acm, &bit_ofs);
+	} else {
+		if (!acm->file_eof)
+			bit_ofs = acm_tell_bits(acm);
+		err = acm_read_block(acm, acm->block);
 	}
-
-	/* to_check? */
-	if ((err = fill_block(acm)) <= 0)
+	if (acm->index && bit_ofs != ~0ULL)
+		acm_index_add(acm, bit_ofs);
+	if (err == 0)
+		return ACM_EXPECTED_EOF;
+	if (err < 0)
 		return err;
 
-	juggle_block(acm);
+	juggle_block(acm, out);
 
 	acm->block_ready = 1;
 
 	return 1;
 }
 
+/*
+ * Parse next block without decoding it.  wrapbuf is not updated,
+ * so stream is not decodable after this until it is repositioned.
+ */
+int acm_scan_block(ACMStream *acm)
+{
+	int res;
+
+	acm->block_ready = 0;
+	acm->block_pos = 0;
+
+	/* header is not needed */
+	GET_BITS_NOERR(res, acm, 20);
+	if (res < 0)
+		return res == ACM_ERR_UNEXPECTED_EOF ? 0 : res;
+
+	res = fill_block(acm, NULL, 1);
+	return res == ACM_EXPECTED_EOF ? 0 : res;
+}
+
 /******************************
  * Output formats
  ******************************/
@@ -654,10 +1270,420 @@ static unsigned char *out_u16be(int *src, unsigned char *dst, unsigned n, unsign
 	return dst;
 }
 
-static int output_values(int *src, unsigned char *dst, int n,
-		int acm_level, int bigendianp, int wordlen, int sgned)
+/* host byte order, with values truncated to 16 bits like above */
+static unsigned char *out_16native(int *src, unsigned char *dst, unsigned n,
+		unsigned shift, unsigned bias)
+{
+	unsigned short tmp;
+	while (n--) {
+		tmp = (*src++ >> shift) ^ bias;
+		memcpy(dst, &tmp, 2);
+		dst += 2;
+	}
+	return dst;
+}
+
+#ifdef __SSE2__
+
+/* truncate to low 16 bits, sign-extended, so pack does not saturate */
+static inline __m128i trunc16(__m128i v, __m128i shift)
+{
+	return _mm_srai_epi32(_mm_slli_epi32(_mm_sra_epi32(v, shift), 16), 16);
+}
+
+/*
+ * 16 values per loop.  "bias" is 0x8000 for unsigned output,
+ * "bswap" selects big-endian output.
+ */
+static unsigned char *out_16_sse2(int *src, unsigned char *dst, unsigned n,
+		unsigned shift, unsigned bias, int bswap)
+{
+	const __m128i cnt = _mm_cvtsi32_si128(shift);
+	const __m128i xbias = _mm_set1_epi16(bias);
+	__m128i a, b;
+	unsigned i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = _mm_packs_epi32(trunc16(_mm_loadu_si128((__m128i *)(src + i)), cnt),
+				    trunc16(_mm_loadu_si128((__m128i *)(src + i + 4)), cnt));
+		b = _mm_packs_epi32(trunc16(_mm_loadu_si128((__m128i *)(src + i + 8)), cnt),
+				    trunc16(_mm_loadu_si128((__m128i *)(src + i + 12)), cnt));
+		a = _mm_xor_si128(a, xbias);
+		b = _mm_xor_si128(b, xbias);
+		if (bswap) {
+			a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+			b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i*2), a);
+		_mm_storeu_si128((__m128i *)(dst + i*2 + 16), b);
+	}
+	dst += i*2;
+	src += i;
+	n -= i;
+	if (!bswap)
+		return out_16native(src, dst, n, shift, bias);
+	if (bias)
+		return out_u16be(src, dst, n, shift);
+	return out_s16be(src, dst, n, shift);
+}
+
+#endif /* __SSE2__ */
+
+/* float in host byte order, scale includes the level shift */
+static unsigned char *out_f32(int *src, unsigned char *dst, unsigned n, float scale)
+{
+	float tmp;
+	while (n--) {
+		tmp = *src++ * scale;
+		memcpy(dst, &tmp, 4);
+		dst += 4;
+	}
+	return dst;
+}
+
+#ifdef __SSE2__
+
+static unsigned char *out_f32_sse2(int *src, unsigned char *dst, unsigned n, float scale)
+{
+	const __m128 mul = _mm_set1_ps(scale);
+	__m128 a, b;
+	unsigned i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(src + i)));
+		b = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(src + i + 4)));
+		_mm_storeu_ps((float *)(dst + i*4), _mm_mul_ps(a, mul));
+		_mm_storeu_ps((float *)(dst + i*4 + 16), _mm_mul_ps(b, mul));
+	}
+	return out_f32(src + i, dst + i*4, n - i, scale);
+}
+
+#endif /* __SSE2__ */
+
+/*
+ * 24- and 32-bit output keeps the bits below 16-bit precision.
+ * Values are range-checked before shifting, so out-of-range values
+ * saturate instead of wrapping.
+ */
+struct WideFmt {
+	int shift;		/* left shift if positive, right if negative */
+	int lo, hi;		/* valid range before shift */
+	int min, max;		/* result for values out of range */
+	unsigned bias;		/* xor with result, for unsigned output */
+};
+
+static void wide_fmt(struct WideFmt *fmt, unsigned bits, unsigned acm_level)
+{
+	int max = (int)(0x7FFFFFFFU >> (32 - bits));
+	int min = -max - 1;
+
+	fmt->min = min;
+	fmt->max = max;
+	fmt->shift = (int)bits - 16 - (int)acm_level;
+	if (fmt->shift >= 0) {
+		fmt->hi = max >> fmt->shift;
+		fmt->lo = min >> fmt->shift;
+	} else {
+		fmt->hi = (int)((unsigned)max << -fmt->shift) | ((1 << -fmt->shift) - 1);
+		fmt->lo = (int)((unsigned)min << -fmt->shift);
+	}
+	fmt->bias = 1U << (bits - 1);
+}
+
+static inline unsigned wide_value(int val, const struct WideFmt *fmt)
+{
+	if (val > fmt->hi)
+		return fmt->max;
+	if (val < fmt->lo)
+		return fmt->min;
+	if (fmt->shift >= 0)
+		return (unsigned)val << fmt->shift;
+	return (unsigned)(val >> -fmt->shift);
+}
+
+static unsigned char *out_wide(int *src, unsigned char *dst, unsigned n,
+		const struct WideFmt *fmt, unsigned bytes, int bigendianp, unsigned bias)
+{
+	unsigned val, i;
+	while (n--) {
+		val = wide_value(*src++, fmt) ^ bias;
+		if (bigendianp) {
+			for (i = bytes; i > 0; i--)
+				*dst++ = (val >> ((i - 1) * 8)) & 0xFF;
+		} else {
+			for (i = 0; i < bytes; i++)
+				*dst++ = (val >> (i * 8)) & 0xFF;
+		}
+	}
+	return dst;
+}
+
+#ifdef __SSE2__
+
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* 8 values per loop, 32-bit values are stored directly, 24-bit bytewise */
+static unsigned char *out_wide_sse2(int *src, unsigned char *dst, unsigned n,
+		const struct WideFmt *fmt, unsigned bytes, int bigendianp, unsigned bias)
+{
+	const __m128i hi = _mm_set1_epi32(fmt->hi);
+	const __m128i lo = _mm_set1_epi32(fmt->lo);
+	const __m128i max = _mm_set1_epi32(fmt->max);
+	const __m128i min = _mm_set1_epi32(fmt->min);
+	const __m128i xbias = _mm_set1_epi32(bias);
+	const __m128i cnt = _mm_cvtsi32_si128(fmt->shift >= 0 ? fmt->shift : -fmt->shift);
+	unsigned tmp[8], i, j;
+	__m128i v[2];
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		for (j = 0; j < 2; j++) {
+			__m128i x = _mm_loadu_si128((__m128i *)(src + i + j*4));
+			__m128i over = _mm_cmpgt_epi32(x, hi);
+			__m128i under = _mm_cmplt_epi32(x, lo);
+			if (fmt->shift >= 0)
+				x = _mm_sll_epi32(x, cnt);
+			else
+				x = _mm_sra_epi32(x, cnt);
+			x = select_si128(over, max, x);
+			x = select_si128(under, min, x);
+			v[j] = _mm_xor_si128(x, xbias);
+		}
+		if (bytes == 4 && !bigendianp) {
+			_mm_storeu_si128((__m128i *)(dst + i*4), v[0]);
+			_mm_storeu_si128((__m128i *)(dst + i*4 + 16), v[1]);
+			continue;
+		}
+		_mm_storeu_si128((__m128i *)tmp, v[0]);
+		_mm_storeu_si128((__m128i *)(tmp + 4), v[1]);
+		for (j = 0; j < 8; j++) {
+			unsigned char *p = dst + (i + j) * bytes;
+			unsigned val = tmp[j];
+			if (bytes == 4 && bigendianp) {
+				p[0] = val >> 24;  p[1] = val >> 16;  p[2] = val >> 8;  p[3] = val;
+			} else if (bigendianp) {
+				p[0] = val >> 16;  p[1] = val >> 8;  p[2] = val;
+			} else {
+				p[0] = val;  p[1] = val >> 8;  p[2] = val >> 16;
+			}
+		}
+	}
+	return out_wide(src + i, dst + i*bytes, n - i, fmt, bytes, bigendianp, bias);
+}
+
+#endif /* __SSE2__ */
+
+/*
+ * Output with gain: value is multiplied with gain and scaled to
+ * output format in same pass.  Gain changes by "step" after every
+ * "per" values.  Limits are same as without gain: integers saturate
+ * at format range, floats are not clamped.
+ */
+struct GainFmt {
+	float mul;		/* level scale to output */
+	float lo, hi;		/* limits in output scale */
+	long max;		/* format maximum, "hi" may round above it */
+	unsigned bytes;		/* 0 for float */
+	unsigned bias;		/* xor with result, for unsigned output */
+	int bigendianp;
+};
+
+static void gain_fmt(struct GainFmt *gf, unsigned acm_level,
+		int bigendianp, int wordlen, int sgned)
+{
+	int bits = wordlen == ACM_FLOAT32 ? 16 : wordlen * 8;
+
+	gf->mul = ldexpf(1.0f, bits - 16 - (int)acm_level);
+	gf->max = (long)(0x7FFFFFFFU >> (32 - bits));
+	gf->lo = (float)(-gf->max - 1);
+	gf->hi = (float)gf->max;
+	gf->bytes = wordlen == ACM_FLOAT32 ? 0 : wordlen;
+	gf->bias = sgned ? 0 : 1U << (bits - 1);
+	gf->bigendianp = bigendianp;
+	if (wordlen == ACM_FLOAT32) {
+		/* 16-bit full scale is 1.0 */
+		gf->mul *= 1.0f / 0x8000;
+		gf->lo = -INFINITY;
+		gf->hi = INFINITY;
+		gf->bias = 0;
+	}
+}
+
+/*
+ * Converts values from "first" to "n", g and step are in output scale.
+ * Returns end of output.
+ */
+static unsigned char *out_gain(int *src, unsigned char *dst, unsigned first, unsigned n,
+		unsigned stride, unsigned per, const struct GainFmt *gf, float g, float step)
+{
+	unsigned i, k, val;
+	long v;
+	float x;
+
+	dst += first * (gf->bytes ? gf->bytes : 4);
+	for (i = first; i < n; i++) {
+		x = src[i * stride] * (g + (i / per) * step);
+		if (x > gf->hi)
+			x = gf->hi;
+		else if (x < gf->lo)
+			x = gf->lo;
+		if (gf->bytes == 0) {
+			memcpy(dst, &x, 4);
+			dst += 4;
+			continue;
+		}
+		v = lrintf(x);
+		if (v > gf->max)
+			v = gf->max;
+		val = (unsigned)v ^ gf->bias;
+		if (gf->bigendianp) {
+			for (k = gf->bytes; k > 0; k--)
+				*dst++ = (val >> ((k - 1) * 8)) & 0xFF;
+		} else {
+			for (k = 0; k < gf->bytes; k++)
+				*dst++ = (val >> (k * 8)) & 0xFF;
+		}
+	}
+	return dst;
+}
+
+#ifdef __SSE2__
+
+/*
+ * Gain for values at frame indexes "fi", computed like g + i * step
+ * in C code, so results match and no error accumulates over fade.
+ */
+static inline __m128 gain_at(__m128 fi, __m128 g, __m128 step)
+{
+	return _mm_add_ps(g, _mm_mul_ps(fi, step));
+}
+
+static inline __m128 gain_ps(__m128i v, __m128 gv, __m128 lo, __m128 hi)
+{
+	return _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), gv), hi), lo);
+}
+
+/* 16-bit and float, mono or stereo, 8 values per loop */
+static unsigned char *out_gain_sse2(int *src, unsigned char *dst, unsigned n,
+		unsigned chans, const struct GainFmt *gf, float g, float step)
+{
+	const __m128 lo = _mm_set1_ps(gf->lo), hi = _mm_set1_ps(gf->hi);
+	const __m128i xbias = _mm_set1_epi16(gf->bias);
+	const __m128 vg = _mm_set1_ps(g), vstep = _mm_set1_ps(step);
+	unsigned i = 0;
+	__m128 fi, inc, a, b;
+	__m128i x;
+
+	if (chans == 1) {
+		fi = _mm_setr_ps(0, 1, 2, 3);
+		inc = _mm_set1_ps(4);
+	} else {
+		fi = _mm_setr_ps(0, 0, 1, 1);
+		inc = _mm_set1_ps(2);
+	}
+	if (gf->bytes == 0 || gf->bytes == 2) {
+		for (; i + 8 <= n; i += 8) {
+			a = gain_ps(_mm_loadu_si128((__m128i *)(src + i)),
+				    gain_at(fi, vg, vstep), lo, hi);
+			fi = _mm_add_ps(fi, inc);
+			b = gain_ps(_mm_loadu_si128((__m128i *)(src + i + 4)),
+				    gain_at(fi, vg, vstep), lo, hi);
+			fi = _mm_add_ps(fi, inc);
+			if (gf->bytes == 0) {
+				_mm_storeu_ps((float *)(dst + i*4), a);
+				_mm_storeu_ps((float *)(dst + i*4 + 16), b);
+				continue;
+			}
+			x = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+			x = _mm_xor_si128(x, xbias);
+			if (gf->bigendianp)
+				x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+			_mm_storeu_si128((__m128i *)(dst + i*2), x);
+		}
+	}
+	return out_gain(src, dst, i, n, 1, chans, gf, g, step);
+}
+
+#endif /* __SSE2__ */
+
+static int output_gain(ACMStream *acm, int *src, unsigned char *dst, unsigned n,
+		int bigendianp, int wordlen, int sgned, float g, float step)
+{
+	unsigned chans = acm->out_chans;
+	struct GainFmt gf;
+
+	gain_fmt(&gf, acm->info.acm_level, bigendianp, wordlen, sgned);
+	g *= gf.mul;
+	step *= gf.mul;
+#ifdef __SSE2__
+	if (acm->simd >= ACM_SIMD_SSE2 && chans <= 2)
+		return out_gain_sse2(src, dst, n, chans, &gf, g, step) - dst;
+#endif
+	return out_gain(src, dst, 0, n, 1, chans, &gf, g, step) - dst;
+}
+
+#ifdef WORDS_BIGENDIAN
+#define NATIVE_BE 1
+#else
+#define NATIVE_BE 0
+#endif
+
+/* bytes per sample, 0 if format is not supported */
+unsigned acm_sample_size(int wordlen)
+{
+	if (wordlen >= 2 && wordlen <= 4)
+		return wordlen;
+	if (wordlen == ACM_FLOAT32)
+		return 4;
+	return 0;
+}
+
+/* gain "g" changes by "step" per frame */
+static int output_values(ACMStream *acm, int *src, unsigned char *dst, int n,
+		int bigendianp, int wordlen, int sgned, float g, float step)
 {
 	unsigned char *res = NULL;
+	unsigned bias = sgned ? 0 : 0x8000;
+	unsigned acm_level = acm->info.acm_level;
+	int simd = acm->simd;
+
+	if (g != 1.0f || step != 0.0f)
+		return output_gain(acm, src, dst, n, bigendianp, wordlen, sgned, g, step);
+
+	if (wordlen == ACM_FLOAT32) {
+		/* 16-bit full scale is 1.0 */
+		float scale = 1.0f / (float)(0x8000 << acm_level);
+#ifdef __SSE2__
+		if (simd >= ACM_SIMD_SSE2)
+			return out_f32_sse2(src, dst, n, scale) - dst;
+#endif
+		return out_f32(src, dst, n, scale) - dst;
+	}
+
+	if (wordlen == 3 || wordlen == 4) {
+		struct WideFmt fmt;
+		wide_fmt(&fmt, wordlen * 8, acm_level);
+		if (sgned)
+			bias = 0;
+		else
+			bias = fmt.bias;
+#ifdef __SSE2__
+		if (simd >= ACM_SIMD_SSE2)
+			return out_wide_sse2(src, dst, n, &fmt, wordlen, bigendianp, bias) - dst;
+#endif
+		return out_wide(src, dst, n, &fmt, wordlen, bigendianp, bias) - dst;
+	}
+
+#ifdef __SSE2__
+	if (wordlen == 2 && simd >= ACM_SIMD_SSE2)
+		return out_16_sse2(src, dst, n, acm_level, bias, bigendianp) - dst;
+#endif
+
+	if (wordlen == 2 && (bigendianp != 0) == NATIVE_BE)
+		return out_16native(src, dst, n, acm_level, bias) - dst;
+
 	if (wordlen == 2) {
 		if (bigendianp == 0) {
 			if (sgned)
@@ -677,18 +1703,205 @@ static int output_values(int *src, unsigned char *dst, int n,
 }
 
 /*
- * WAVC (compressed WAV) files are ACM files with additional header.
- *
- * 'WAVC' + 'V1.00' + uncompr(4b) + compr(4b) + 12b
+ * Planar output: channel "c" of each frame goes to dst[c].
  */
 
-#define WAVC_ID 0x564157  /* 'WAV' */
+static void planar_16(int *src, unsigned char *dst, unsigned n, unsigned stride,
+		unsigned shift, unsigned bias, int bigendianp)
+{
+	unsigned val;
+	while (n--) {
+		val = (*src >> shift) ^ bias;
+		src += stride;
+		if (bigendianp) {
+			*dst++ = (val >> 8) & 0xFF;
+			*dst++ = val & 0xFF;
+		} else {
+			*dst++ = val & 0xFF;
+			*dst++ = (val >> 8) & 0xFF;
+		}
+	}
+}
 
-static int read_wavc_header(ACMStream *acm)
+static void planar_f32(int *src, unsigned char *dst, unsigned n, unsigned stride, float scale)
 {
-	static const unsigned short expect[12] = {
-		/* 'V1.0', raw_size, acm_size */
-		0x3156, 0x302E, 0,0, 0,0,
+	float tmp;
+	while (n--) {
+		tmp = *src * scale;
+		src += stride;
+		memcpy(dst, &tmp, 4);
+		dst += 4;
+	}
+}
+
+#ifdef __SSE2__
+
+/* split 2 vectors of stereo frames to left and right values */
+#define DEINTERLEAVE2(a, b, l, r) do { \
+		__m128i _a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0)); \
+		__m128i _b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0)); \
+		l = _mm_unpacklo_epi64(_a, _b); \
+		r = _mm_unpackhi_epi64(_a, _b); \
+	} while (0)
+
+/* stereo, 8 frames per loop */
+static unsigned planar2_16_sse2(int *src, unsigned char *l, unsigned char *r,
+		unsigned n, unsigned shift, unsigned bias, int bswap)
+{
+	const __m128i cnt = _mm_cvtsi32_si128(shift);
+	const __m128i xbias = _mm_set1_epi16(bias);
+	__m128i l0, l1, r0, r1, a, b;
+	unsigned i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		DEINTERLEAVE2(_mm_loadu_si128((__m128i *)(src + i*2)),
+			      _mm_loadu_si128((__m128i *)(src + i*2 + 4)), l0, r0);
+		DEINTERLEAVE2(_mm_loadu_si128((__m128i *)(src + i*2 + 8)),
+			      _mm_loadu_si128((__m128i *)(src + i*2 + 12)), l1, r1);
+		a = _mm_packs_epi32(trunc16(l0, cnt), trunc16(l1, cnt));
+		b = _mm_packs_epi32(trunc16(r0, cnt), trunc16(r1, cnt));
+		a = _mm_xor_si128(a, xbias);
+		b = _mm_xor_si128(b, xbias);
+		if (bswap) {
+			a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+			b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		}
+		_mm_storeu_si128((__m128i *)(l + i*2), a);
+		_mm_storeu_si128((__m128i *)(r + i*2), b);
+	}
+	return i;
+}
+
+/* stereo, 4 frames per loop */
+static unsigned planar2_f32_sse2(int *src, unsigned char *l, unsigned char *r,
+		unsigned n, float scale)
+{
+	const __m128 mul = _mm_set1_ps(scale);
+	__m128i a, b;
+	unsigned i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		DEINTERLEAVE2(_mm_loadu_si128((__m128i *)(src + i*2)),
+			      _mm_loadu_si128((__m128i *)(src + i*2 + 4)), a, b);
+		_mm_storeu_ps((float *)(l + i*4), _mm_mul_ps(_mm_cvtepi32_ps(a), mul));
+		_mm_storeu_ps((float *)(r + i*4), _mm_mul_ps(_mm_cvtepi32_ps(b), mul));
+	}
+	return i;
+}
+
+/* stereo with gain, 4 frames per loop, g and step in output scale */
+static unsigned planar2_gain_sse2(int *src, unsigned char *l, unsigned char *r,
+		unsigned n, const struct GainFmt *gf, float g, float step)
+{
+	const __m128 lo = _mm_set1_ps(gf->lo), hi = _mm_set1_ps(gf->hi);
+	const __m128 vg = _mm_set1_ps(g), vstep = _mm_set1_ps(step);
+	const __m128 inc = _mm_set1_ps(4);
+	const __m128i xbias = _mm_set1_epi16(gf->bias);
+	__m128 fi = _mm_setr_ps(0, 1, 2, 3);
+	__m128 gv, fa, fb;
+	__m128i a, b;
+	unsigned i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		DEINTERLEAVE2(_mm_loadu_si128((__m128i *)(src + i*2)),
+			      _mm_loadu_si128((__m128i *)(src + i*2 + 4)), a, b);
+		gv = gain_at(fi, vg, vstep);
+		fi = _mm_add_ps(fi, inc);
+		fa = gain_ps(a, gv, lo, hi);
+		fb = gain_ps(b, gv, lo, hi);
+		if (gf->bytes == 0) {
+			_mm_storeu_ps((float *)(l + i*4), fa);
+			_mm_storeu_ps((float *)(r + i*4), fb);
+			continue;
+		}
+		a = _mm_cvtps_epi32(fa);
+		b = _mm_cvtps_epi32(fb);
+		a = _mm_xor_si128(_mm_packs_epi32(a, a), xbias);
+		b = _mm_xor_si128(_mm_packs_epi32(b, b), xbias);
+		if (gf->bigendianp) {
+			a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+			b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		}
+		_mm_storel_epi64((__m128i *)(l + i*2), a);
+		_mm_storel_epi64((__m128i *)(r + i*2), b);
+	}
+	return i;
+}
+
+#endif /* __SSE2__ */
+
+static void planar_gain(ACMStream *acm, int *src, void **dst, unsigned ofs, unsigned n,
+		int bigendianp, int wordlen, int sgned, float g, float step)
+{
+	unsigned chans = acm->out_chans, size = acm_sample_size(wordlen), done = 0, c;
+	struct GainFmt gf;
+
+	gain_fmt(&gf, acm->info.acm_level, bigendianp, wordlen, sgned);
+	g *= gf.mul;
+	step *= gf.mul;
+#ifdef __SSE2__
+	if (chans == 2 && acm->simd >= ACM_SIMD_SSE2)
+		done = planar2_gain_sse2(src, (unsigned char *)dst[0] + ofs*size,
+					 (unsigned char *)dst[1] + ofs*size, n, &gf, g, step);
+#endif
+	for (c = 0; c < chans; c++)
+		out_gain(src + c, (unsigned char *)dst[c] + ofs*size, done, n,
+			 chans, 1, &gf, g, step);
+}
+
+/* convert "n" frames, writing starting from frame "ofs" in dst */
+static void output_planar(ACMStream *acm, int *src, void **dst, unsigned ofs, unsigned n,
+		int bigendianp, int wordlen, int sgned, float g, float step)
+{
+	unsigned chans = acm->out_chans, acm_level = acm->info.acm_level;
+	unsigned size = acm_sample_size(wordlen), done = 0, c;
+	unsigned bias = sgned ? 0 : 0x8000;
+	float scale = 1.0f / (float)(0x8000 << acm_level);
+
+	if (chans == 1) {
+		output_values(acm, src, (unsigned char *)dst[0] + ofs*size, n,
+			      bigendianp, wordlen, sgned, g, step);
+		return;
+	}
+	if (g != 1.0f || step != 0.0f) {
+		planar_gain(acm, src, dst, ofs, n, bigendianp, wordlen, sgned, g, step);
+		return;
+	}
+
+#ifdef __SSE2__
+	if (chans == 2 && acm->simd >= ACM_SIMD_SSE2) {
+		unsigned char *l = (unsigned char *)dst[0] + ofs*size;
+		unsigned char *r = (unsigned char *)dst[1] + ofs*size;
+		if (wordlen == ACM_FLOAT32)
+			done = planar2_f32_sse2(src, l, r, n, scale);
+		else
+			done = planar2_16_sse2(src, l, r, n, acm_level, bias, bigendianp);
+	}
+#endif
+
+	for (c = 0; c < chans; c++) {
+		unsigned char *p = (unsigned char *)dst[c] + (ofs + done)*size;
+		if (wordlen == ACM_FLOAT32)
+			planar_f32(src + done*chans + c, p, n - done, chans, scale);
+		else
+			planar_16(src + done*chans + c, p, n - done, chans,
+				  acm_level, bias, bigendianp);
+	}
+}
+
+/*
+ * WAVC (compressed WAV) files are ACM files with additional header.
+ *
+ * 'WAVC' + 'V1.00' + uncompr(4b) + compr(4b) + 12b
+ */
+
+#define WAVC_ID 0x564157  /* 'WAV' */
+
+static int read_wavc_header(ACMStream *acm)
+{
+	static const unsigned short expect[12] = {
+		/* 'V1.0', raw_size, acm_size */
+		0x3156, 0x302E, 0,0, 0,0,
 		/* hdrlen?, chans?, bits?, hz */
 		28,0, 1, 16, 22050, 0
 	};
@@ -752,37 +1965,67 @@ static int read_header(ACMStream *acm)
 }
 
 /***********************************************
- * Public functions
+ * CPU detection
  ***********************************************/
 
-int acm_open_decoder(ACMStream **res, void *arg, acm_io_callbacks io_cb, int force_chans)
+static int detect_simd(void)
 {
-	int err = ACM_ERR_OTHER;
-	ACMStream *acm;
-	
-	acm = malloc(sizeof(*acm));
-	if (!acm)
-		return err;
-	memset(acm, 0, sizeof(*acm));
+	int level = ACM_SIMD_NONE;
+#ifdef __SSE2__
+	level = ACM_SIMD_SSE2;
+#endif
+#ifdef USE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		level = ACM_SIMD_AVX2;
+#endif
+	return level;
+}
 
-	acm->io_arg = arg;
-	acm->io = io_cb;
+static void init_simd(void)
+{
+	simd_default = detect_simd();
+}
 
-	if (acm->io.get_length_func) {
-		acm->data_len = acm->io.get_length_func(acm->io_arg);
-	} else {
-		acm->data_len = 0;
-	}
-	
-	acm->buf_max = ACM_BUFLEN;
-	acm->buf = malloc(acm->buf_max);
-	if (!acm->buf) 
-		goto err_out;
+/* detection runs once, also when streams are opened in several threads */
+static int default_simd(void)
+{
+#ifdef HAVE_PTHREAD_H
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, init_simd);
+#else
+	if (simd_default == ACM_SIMD_AUTO)
+		init_simd();
+#endif
+	return simd_default;
+}
+
+int acm_get_simd(void)
+{
+	return default_simd();
+}
+
+int acm_set_simd(int level)
+{
+	int best = detect_simd();
+
+	default_simd();
+	if (level < 0 || level > best)
+		level = best;
+	simd_default = level;
+	return level;
+}
+
+/***********************************************
+ * Public functions
+ ***********************************************/
 
+/* common part of opening, buffer must be set up */
+static int open_stream(ACMStream *acm, int force_chans)
+{
 	/* read header data */
-	err = ACM_ERR_NOT_ACM;
 	if (read_header(acm) < 0)
-		goto err_out;
+		return ACM_ERR_NOT_ACM;
 
 	/*
 	 * Overwrite channel info if requested, if force_chans == 0
@@ -797,20 +2040,55 @@ int acm_open_decoder(ACMStream **res, void *arg, acm_io_callbacks io_cb, int for
 	else if (force_chans == -1 && !acm->wavc_file && acm->info.channels < 2)
 		acm->info.channels = 2;
 	/* else if force_chans == 0, trust the file's header */
+	acm->out_chans = acm->info.channels;
+	acm->gain = 1.0f;
 
 	/* calculate blocks */
 	acm->info.acm_cols = 1 << acm->info.acm_level;
 	acm->wrapbuf_len = 2 * acm->info.acm_cols - 2;
 	acm->block_len = acm->info.acm_rows * acm->info.acm_cols;
+	calc_fast_len(acm);
+
+	/* fixed for stream, acm_set_simd() does not change running code */
+	acm->simd = default_simd();
 
 	/* allocate */
 	acm->block = malloc(acm->block_len * sizeof(int));
+	acm->colbuf = malloc(TILE_COLS * acm->info.acm_rows * sizeof(int));
 	acm->wrapbuf = malloc(acm->wrapbuf_len * sizeof(int));
-	acm->ampbuf = malloc(0x10000 * sizeof(int));
-	acm->midbuf = acm->ampbuf + 0x8000;
 
 	memset(acm->wrapbuf, 0, acm->wrapbuf_len * sizeof(int));
 
+	return ACM_OK;
+}
+
+int acm_open_decoder(ACMStream **res, void *arg, acm_io_callbacks io_cb, int force_chans)
+{
+	int err = ACM_ERR_OTHER;
+	ACMStream *acm;
+	
+	acm = malloc(sizeof(*acm));
+	if (!acm)
+		return err;
+	memset(acm, 0, sizeof(*acm));
+
+	acm->io_arg = arg;
+	acm->io = io_cb;
+
+	if (acm->io.get_length_func) {
+		acm->data_len = acm->io.get_length_func(acm->io_arg);
+	} else {
+		acm->data_len = 0;
+	}
+	
+	acm->buf_max = ACM_BUFLEN;
+	acm->buf = malloc(acm->buf_max);
+	if (!acm->buf) 
+		goto err_out;
+
+	if ((err = open_stream(acm, force_chans)) < 0)
+		goto err_out;
+
 	*res = acm;
 	return ACM_OK;
 
@@ -823,22 +2101,173 @@ err_out:
 	return err;
 }
 
-int acm_read(ACMStream *acm, void *dst, unsigned numbytes,
-		 int bigendianp, int wordlen, int sgned)
+int acm_open_memory(ACMStream **res, const void *data, unsigned len, int force_chans)
 {
-	int avail, gotbytes = 0, err;
-	int *src, numwords;
+	int err = ACM_ERR_OTHER;
+	ACMStream *acm;
 
-	if (wordlen == 2)
-		numwords = numbytes / 2;
-	else
-		return ACM_ERR_BADFMT;
+	acm = malloc(sizeof(*acm));
+	if (!acm)
+		return err;
+	memset(acm, 0, sizeof(*acm));
+
+	/* bit reader works directly on caller data */
+	acm->mem_data = 1;
+	acm->data_len = len;
+	acm->buf = (unsigned char *)data;
+	acm->buf_max = len;
+	acm->buf_size = len;
+
+	if ((err = open_stream(acm, force_chans)) < 0) {
+		acm_close(acm);
+		return err;
+	}
+
+	*res = acm;
+	return ACM_OK;
+}
+
+/******************************
+ * Output stage
+ ******************************/
+
+/* frames processed at once by output stage */
+#define OUT_FRAMES	1024
+
+/* is output different from decoded stream */
+static inline int use_out_stage(ACMStream *acm)
+{
+	return acm->resampler != NULL || acm->out_chans != acm->info.channels;
+}
+
+/*
+ * Channel remix, only between mono and stereo.  Works in place:
+ * downmix goes forward and upmix backward over the values.
+ */
+
+static void downmix(const int *src, int *dst, unsigned n)
+{
+	unsigned i;
+	for (i = 0; i < n; i++)
+		dst[i] = (src[i*2] >> 1) + (src[i*2 + 1] >> 1);
+}
+
+static void upmix(const int *src, int *dst, unsigned n)
+{
+	unsigned i = n;
+	int val;
+	while (i > 0) {
+		i--;
+		val = src[i];
+		dst[i*2 + 1] = val;
+		dst[i*2] = val;
+	}
+}
+
+#ifdef __SSE2__
+
+static void downmix_sse2(const int *src, int *dst, unsigned n)
+{
+	__m128i l, r;
+	unsigned i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		DEINTERLEAVE2(_mm_loadu_si128((__m128i *)(src + i*2)),
+			      _mm_loadu_si128((__m128i *)(src + i*2 + 4)), l, r);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_add_epi32(_mm_srai_epi32(l, 1), _mm_srai_epi32(r, 1)));
+	}
+	downmix(src + i*2, dst + i, n - i);
+}
+
+static void upmix_sse2(const int *src, int *dst, unsigned n)
+{
+	unsigned i = n & ~3U;
+	__m128i v;
+
+	upmix(src + i, dst + i*2, n - i);
+	while (i > 0) {
+		i -= 4;
+		v = _mm_loadu_si128((__m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i*2), _mm_unpacklo_epi32(v, v));
+		_mm_storeu_si128((__m128i *)(dst + i*2 + 4), _mm_unpackhi_epi32(v, v));
+	}
+}
+
+#endif /* __SSE2__ */
+
+static void remix(const int *src, int *dst, unsigned n, unsigned in_chans, unsigned out_chans,
+		  int simd)
+{
+	if (in_chans == out_chans) {
+		if (src != dst)
+			memcpy(dst, src, n * in_chans * sizeof(int));
+	} else if (in_chans == 2) {
+#ifdef __SSE2__
+		if (simd >= ACM_SIMD_SSE2) {
+			downmix_sse2(src, dst, n);
+			return;
+		}
+#endif
+		downmix(src, dst, n);
+	} else {
+#ifdef __SSE2__
+		if (simd >= ACM_SIMD_SSE2) {
+			upmix_sse2(src, dst, n);
+			return;
+		}
+#endif
+		upmix(src, dst, n);
+	}
+}
+
+/* start over, after setup or seek */
+static void reset_out_stage(ACMStream *acm)
+{
+	acm->out_pos = acm->out_len = 0;
+	acm->out_src_pos = acm->stream_pos;
+	if (acm->resampler)
+		acm_resampler_reset(acm->resampler);
+}
+
+static int setup_out_stage(ACMStream *acm)
+{
+	unsigned in = acm->info.channels, out = acm->out_chans;
+
+	/* resample with fewer channels: downmix before, upmix after */
+	acm_resampler_free(acm->resampler);
+	acm->resampler = NULL;
+	if (acm->out_rate && acm->out_rate != acm->info.rate) {
+		acm->resampler = acm_resampler_new(in < out ? in : out, acm->info.rate,
+						   acm->out_rate, acm->simd);
+		if (acm->resampler == NULL)
+			return ACM_ERR_BADFMT;
+	}
+
+	if (acm->outbuf)
+		free(acm->outbuf);
+	acm->outbuf = NULL;
+	if (use_out_stage(acm)) {
+		acm->outbuf = malloc(OUT_FRAMES * (in > out ? in : out) * sizeof(int));
+		if (acm->outbuf == NULL)
+			return ACM_ERR_OTHER;
+	}
+
+	reset_out_stage(acm);
+	return ACM_OK;
+}
+
+/* next decoded values from block, returns count or 0 on EOF */
+static int block_values(ACMStream *acm, int **src, unsigned maxwords)
+{
+	unsigned n;
+	int err;
 
 	if (acm->stream_pos >= acm->total_values)
 		return 0;
 
 	if (!acm->block_ready) {
-		err = decode_block(acm);
+		err = decode_block(acm, NULL);
 		if (err == ACM_EXPECTED_EOF)
 			return 0;
 		if (err < 0)
@@ -846,49 +2275,417 @@ int acm_read(ACMStream *acm, void *dst, unsigned numbytes,
 	}
 
 	/* check how many words can be read */
-	avail = acm->block_len - acm->block_pos;
-	if (avail < numwords)
-		numwords = avail;
+	n = acm->block_len - acm->block_pos;
+	if (n > maxwords)
+		n = maxwords;
 
-	if (acm->stream_pos + numwords > acm->total_values)
-		numwords = acm->total_values - acm->stream_pos;
+	if (acm->stream_pos + n > acm->total_values)
+		n = acm->total_values - acm->stream_pos;
 
 	if (acm->info.channels > 1)
-		numwords -= numwords % acm->info.channels;
-
-	/* convert, but if dst == NULL, simulate */
-	if (dst != NULL) {
-		src = acm->block + acm->block_pos;
-		gotbytes = output_values(src, dst, numwords,
-				acm->info.acm_level,
-				bigendianp, wordlen, sgned);
-	} else
-		gotbytes = numwords * wordlen;
-
-	if (gotbytes >= 0) {
-		acm->stream_pos += numwords;
-		acm->block_pos += numwords;
-		if (acm->block_pos == acm->block_len)
-			acm->block_ready = 0;
+		n -= n % acm->info.channels;
+
+	*src = acm->block + acm->block_pos;
+	return n;
+}
+
+static void skip_block_values(ACMStream *acm, unsigned n)
+{
+	acm->stream_pos += n;
+	acm->block_pos += n;
+	if (acm->block_pos == acm->block_len)
+		acm->block_ready = 0;
+}
+
+/* run decoded values through output stage into outbuf */
+static int fill_output(ACMStream *acm)
+{
+	unsigned in = acm->info.channels, out = acm->out_chans, n;
+	struct ACMResampler *rs = acm->resampler;
+	int *src, res;
+
+	acm->out_pos = acm->out_len = 0;
+	while (1) {
+		if (rs) {
+			n = acm_resampler_pull(rs, acm->outbuf, OUT_FRAMES);
+			if (n > 0) {
+				if (out > in)
+					remix(acm->outbuf, acm->outbuf, n, in, out, acm->simd);
+				break;
+			}
+		}
+
+		res = block_values(acm, &src, OUT_FRAMES * in);
+		if (res < 0)
+			return res;
+		if (res == 0) {
+			if (rs && acm_resampler_flush(rs))
+				continue;
+			return 0;
+		}
+		n = res / in;
+
+		if (rs == NULL || out < in) {
+			remix(src, acm->outbuf, n, in, out, acm->simd);
+			src = acm->outbuf;
+		}
+		if (rs)
+			n = acm_resampler_push(rs, src, n);
+		skip_block_values(acm, n * in);
+		acm->out_src_pos = acm->stream_pos;
+		if (rs == NULL)
+			break;
+	}
+	acm->out_len = n * out;
+	return n;
+}
+
+/* next values from output stage */
+static int out_values(ACMStream *acm, int **src, unsigned maxwords)
+{
+	unsigned n;
+	int res;
+
+	/* stream was seeked, start over */
+	if (acm->out_src_pos != acm->stream_pos)
+		reset_out_stage(acm);
+
+	if (acm->out_pos == acm->out_len) {
+		res = fill_output(acm);
+		if (res <= 0)
+			return res;
+	}
+
+	n = acm->out_len - acm->out_pos;
+	if (n > maxwords)
+		n = maxwords;
+	n -= n % acm->out_chans;
+
+	*src = acm->outbuf + acm->out_pos;
+	return n;
+}
+
+/*
+ * Gain is applied during conversion to output format, so changes
+ * take effect on next read.
+ */
+
+/*
+ * Gain for next "nframes" frames: starts from "g", changes by "step"
+ * per frame.  Returns frames it is valid for, less than "nframes" if
+ * fade ends before.
+ */
+static unsigned gain_span(ACMStream *acm, unsigned nframes, float *g, float *step)
+{
+	unsigned n = nframes;
+
+	*g = acm->gain;
+	*step = 0;
+	if (acm->fade_left == 0)
+		return n;
+	if (n > acm->fade_left)
+		n = acm->fade_left;
+	if (n == 0)
+		return 0;
+	*step = (acm->gain_target - acm->gain) / acm->fade_left;
+	acm->fade_left -= n;
+	if (acm->fade_left == 0)
+		acm->gain = acm->gain_target;
+	else
+		acm->gain += *step * n;
+	return n;
+}
+
+static int convert_values(ACMStream *acm, int *src, unsigned char *dst, unsigned n,
+		int bigendianp, int wordlen, int sgned)
+{
+	unsigned chans = acm->out_chans, size = acm_sample_size(wordlen);
+	unsigned done, part;
+	float g, step;
+	int res;
+
+	for (done = 0; done < n; done += part) {
+		part = gain_span(acm, (n - done) / chans, &g, &step) * chans;
+		/* partial frame at end */
+		if (part == 0)
+			part = n - done;
+		res = output_values(acm, src + done, dst + done*size, part,
+				    bigendianp, wordlen, sgned, g, step);
+		if (res < 0)
+			return res;
+	}
+	return n * size;
+}
+
+/* in-place version for acm_read_values(), saturates only at int range */
+
+/* values from "first" to "n" */
+static void gain_values(int *v, unsigned first, unsigned n, unsigned chans,
+			float g, float step, float lo, float hi)
+{
+	unsigned i;
+	float x;
+
+	for (i = first; i < n; i++) {
+		x = v[i] * (g + (i / chans) * step);
+		if (x > hi)
+			x = hi;
+		else if (x < lo)
+			x = lo;
+		v[i] = lrintf(x);
+	}
+}
+
+#ifdef __SSE2__
+
+/* gain changes by "step" per frame, mono or stereo */
+static void gain_values_sse2(int *v, unsigned n, unsigned chans, float g, float step,
+			     float lo, float hi)
+{
+	const __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+	const __m128 vg = _mm_set1_ps(g), vstep = _mm_set1_ps(step);
+	__m128 fi, inc, x;
+	unsigned i;
+
+	if (chans == 1) {
+		fi = _mm_setr_ps(0, 1, 2, 3);
+		inc = _mm_set1_ps(4);
+	} else {
+		fi = _mm_setr_ps(0, 0, 1, 1);
+		inc = _mm_set1_ps(2);
 	}
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = gain_ps(_mm_loadu_si128((__m128i *)(v + i)), gain_at(fi, vg, vstep), vlo, vhi);
+		_mm_storeu_si128((__m128i *)(v + i), _mm_cvtps_epi32(x));
+		fi = _mm_add_ps(fi, inc);
+	}
+	gain_values(v, i, n, chans, g, step, lo, hi);
+}
+
+#endif /* __SSE2__ */
+
+static void apply_gain(ACMStream *acm, int *v, unsigned nframes)
+{
+	unsigned chans = acm->out_chans, n;
+	/* largest floats that convert to int without overflow */
+	float lo = -2147483648.0f, hi = 2147483520.0f;
+	float g, step;
+
+	for (; nframes > 0; nframes -= n) {
+		n = gain_span(acm, nframes, &g, &step);
+		if (g == 1.0f && step == 0.0f)
+			break;
+#ifdef __SSE2__
+		if (acm->simd >= ACM_SIMD_SSE2 && chans <= 2)
+			gain_values_sse2(v, n * chans, chans, g, step, lo, hi);
+		else
+#endif
+			gain_values(v, 0, n * chans, chans, g, step, lo, hi);
+		v += n * chans;
+	}
+}
+
+/*
+ * Values for output, "raw" gives decoded values even if
+ * output stage is used, for seeking.
+ */
+static int next_values(ACMStream *acm, int **src, unsigned maxwords, int raw)
+{
+	if (use_out_stage(acm) && !raw)
+		return out_values(acm, src, maxwords);
+	return block_values(acm, src, maxwords);
+}
+
+static void used_values(ACMStream *acm, unsigned n, int raw)
+{
+	if (use_out_stage(acm) && !raw)
+		acm->out_pos += n;
+	else
+		skip_block_values(acm, n);
+}
+
+int acm_set_rate(ACMStream *acm, unsigned rate)
+{
+	unsigned old = acm->out_rate;
+	int err;
+
+	acm->out_rate = rate;
+	if ((err = setup_out_stage(acm)) < 0) {
+		acm->out_rate = old;
+		setup_out_stage(acm);
+	}
+	return err;
+}
+
+int acm_set_channels(ACMStream *acm, unsigned chans)
+{
+	unsigned old = acm->out_chans;
+	int err;
+
+	if (chans != acm->info.channels && (chans > 2 || acm->info.channels > 2 || chans < 1))
+		return ACM_ERR_BADFMT;
+
+	acm->out_chans = chans;
+	if ((err = setup_out_stage(acm)) < 0) {
+		acm->out_chans = old;
+		setup_out_stage(acm);
+	}
+	return err;
+}
+
+int acm_set_gain(ACMStream *acm, unsigned gain)
+{
+	acm->gain = (float)gain / ACM_GAIN_UNITY;
+	acm->fade_left = 0;
+	return ACM_OK;
+}
+
+int acm_fade(ACMStream *acm, unsigned gain, unsigned nframes)
+{
+	acm->gain_target = (float)gain / ACM_GAIN_UNITY;
+	acm->fade_left = nframes;
+	if (nframes == 0)
+		acm->gain = acm->gain_target;
+	return ACM_OK;
+}
+
+/******************************
+ * Reading
+ ******************************/
+
+int acm_read(ACMStream *acm, void *dst, unsigned numbytes,
+		 int bigendianp, int wordlen, int sgned)
+{
+	int *src, numwords;
+
+	if (acm_sample_size(wordlen) == 0)
+		return ACM_ERR_BADFMT;
+
+	/* if dst == NULL, skip decoded values */
+	numwords = next_values(acm, &src, numbytes / acm_sample_size(wordlen), dst == NULL);
+	if (numwords <= 0)
+		return numwords;
+
+	if (dst != NULL)
+		convert_values(acm, src, dst, numwords, bigendianp, wordlen, sgned);
 
-	return gotbytes;
+	used_values(acm, numwords, dst == NULL);
+
+	return numwords * acm_sample_size(wordlen);
+}
+
+int acm_read_values(ACMStream *acm, int **values, unsigned maxframes)
+{
+	unsigned chans = acm->out_chans;
+	int n;
+
+	n = next_values(acm, values, maxframes * chans, 0);
+	if (n <= 0)
+		return n;
+	apply_gain(acm, *values, n / chans);
+	used_values(acm, n, 0);
+	return n / chans;
+}
+
+int acm_read_planar(ACMStream *acm, void **dst, unsigned nframes,
+		int bigendianp, int wordlen, int sgned)
+{
+	unsigned chans = acm->out_chans, got = 0, n, done, part;
+	float g, step;
+	int *src, res;
+
+	if (wordlen != 2 && wordlen != ACM_FLOAT32)
+		return ACM_ERR_BADFMT;
+
+	while (got < nframes) {
+		res = next_values(acm, &src, (nframes - got) * chans, 0);
+		if (res < 0)
+			return got > 0 ? (int)got : res;
+		n = res / chans;
+		if (n == 0)
+			break;
+
+		for (done = 0; done < n; done += part) {
+			part = gain_span(acm, n - done, &g, &step);
+			output_planar(acm, src + done*chans, dst, got + done, part,
+				      bigendianp, wordlen, sgned, g, step);
+		}
+
+		got += n;
+		used_values(acm, n * chans, 0);
+	}
+	return got;
+}
+
+/* strips converted during juggle are whole frames, so fade steps match */
+static int frame_strips(ACMStream *acm)
+{
+	if (acm->info.acm_level == 0)
+		return acm->block_len % acm->out_chans == 0;
+	return acm->info.acm_cols % acm->out_chans == 0;
+}
+
+int acm_read_frames(ACMStream *acm, void *dst, unsigned nframes,
+		int bigendianp, int wordlen, int sgned)
+{
+	unsigned chans = acm->out_chans, size = acm_sample_size(wordlen);
+	unsigned got = 0, want = nframes * chans;
+	unsigned char *p = dst;
+	int res;
+
+	if (size == 0)
+		return ACM_ERR_BADFMT;
+
+	while (got < want) {
+		/* whole block fits, convert during juggle */
+		if (!acm->block_ready && !use_out_stage(acm)
+		    && (acm->fade_left == 0 || frame_strips(acm))
+		    && want - got >= acm->block_len
+		    && acm->stream_pos + acm->block_len <= acm->total_values)
+		{
+			struct OutArgs out = { p + got*size, bigendianp, wordlen, sgned };
+			res = decode_block(acm, &out);
+			if (res == ACM_EXPECTED_EOF)
+				break;
+			if (res < 0)
+				return got > 0 ? (int)(got / chans) : res;
+			acm->block_ready = 0;
+			acm->stream_pos += acm->block_len;
+			got += acm->block_len;
+			continue;
+		}
+
+		res = acm_read(acm, p + got*size, (want - got)*size,
+			       bigendianp, wordlen, sgned);
+		if (res < 0 && got == 0)
+			return res;
+		if (res <= 0)
+			break;
+		got += res / size;
+	}
+	return got / chans;
 }
 
 void acm_close(ACMStream *acm)
 {
 	if (acm == NULL)
 		return;
+	/* worker uses the buffers */
+	acm_pipe_free(acm);
 	if (acm->io.close_func)
 		acm->io.close_func(acm->io_arg);
-	if (acm->buf)
+	if (acm->buf && !acm->mem_data)
 		free(acm->buf);
 	if (acm->block)
 		free(acm->block);
+	if (acm->colbuf)
+		free(acm->colbuf);
 	if (acm->wrapbuf)
 		free(acm->wrapbuf);
-	if (acm->ampbuf)
-		free(acm->ampbuf);
+	if (acm->outbuf)
+		free(acm->outbuf);
+	acm_resampler_free(acm->resampler);
+	acm_index_clear(acm);
 	free(acm);
 }
 
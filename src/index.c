@@ -0,0 +1,611 @@
+/*
+ * Seek index for libacm.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libacm.h"
+#include "index.h"
+#include "pipeline.h"
+
+/* default checkpoint interval, in frames */
+#define INDEX_INTERVAL	8192
+
+/* index file header is ten 32-bit words, first is magic */
+#define IDX_MAGIC	"ACMI"
+#define IDX_VERSION	2
+#define IDX_HDR_LEN	40
+
+/* bytes hashed from start and end of stream */
+#define HASH_LEN	(64*1024)
+
+/* bytes hashed at each checkpoint */
+#define CHECK_LEN	16
+
+#define FNV_INIT	0xCBF29CE484222325ULL
+
+/* make room for one more checkpoint */
+static int grow_index(ACMStream *acm, struct ACMIndex *idx)
+{
+	unsigned max = idx->max ? idx->max * 2 : 64;
+	unsigned long long *ofs;
+	int *wrap;
+
+	ofs = realloc(idx->bit_ofs, max * sizeof(*ofs));
+	if (ofs == NULL)
+		return ACM_ERR_OTHER;
+	idx->bit_ofs = ofs;
+
+	if (acm->wrapbuf_len > 0) {
+		wrap = realloc(idx->wrap, max * acm->wrapbuf_len * sizeof(int));
+		if (wrap == NULL)
+			return ACM_ERR_OTHER;
+		idx->wrap = wrap;
+	}
+	idx->max = max;
+	return 0;
+}
+
+void acm_index_add(ACMStream *acm, unsigned long long bit_ofs)
+{
+	struct ACMIndex *idx = acm->index;
+	unsigned block = acm->stream_pos / acm->block_len;
+
+	/* only next missing one */
+	if (block != (idx->count + 1) * idx->step)
+		return;
+	if (idx->count == idx->max && grow_index(acm, idx) < 0)
+		return;
+
+	idx->bit_ofs[idx->count] = bit_ofs;
+	memcpy(idx->wrap + idx->count * acm->wrapbuf_len, acm->wrapbuf,
+	       acm->wrapbuf_len * sizeof(int));
+	idx->count++;
+}
+
+int acm_index_seek(ACMStream *acm, unsigned word_pos)
+{
+	struct ACMIndex *idx = acm->index;
+	unsigned i, pos;
+	int err;
+
+	if (idx == NULL)
+		return 0;
+	i = word_pos / acm->block_len / idx->step;
+	if (i > idx->count)
+		i = idx->count;
+	if (i == 0)
+		return 0;
+	pos = i * idx->step * acm->block_len;
+
+	/* current position is closer */
+	if (pos <= acm->stream_pos && acm->stream_pos <= word_pos)
+		return 0;
+
+	i--;
+	if ((err = acm_index_check(acm, i)) <= 0) {
+		if (err < 0)
+			return err;
+		/* stream has changed since index was saved */
+		acm_index_clear(acm);
+		return 0;
+	}
+	if ((err = acm_seek_bits(acm, idx->bit_ofs[i])) < 0)
+		return err;
+	memcpy(acm->wrapbuf, idx->wrap + i * acm->wrapbuf_len,
+	       acm->wrapbuf_len * sizeof(int));
+	acm->stream_pos = pos;
+	acm->block_pos = 0;
+	acm->block_ready = 0;
+	return 1;
+}
+
+/* forget current position, so next seek restores decoder state */
+static void drop_position(ACMStream *acm)
+{
+	acm->stream_pos = ~0U;
+	acm->block_ready = 0;
+}
+
+/*
+ * Juggle looks back less than 2 * acm_cols values, so after decoding
+ * that many, wrapbuf is same as when decoding from start.
+ */
+unsigned acm_warmup_blocks(ACMStream *acm)
+{
+	return (2 * acm->info.acm_cols + acm->block_len - 1) / acm->block_len;
+}
+
+/*
+ * Only blocks just before checkpoints are decoded, others are scanned.
+ * Errors just end the index, reading will see them too.
+ */
+static void index_pass(ACMStream *acm, struct ACMIndex *idx)
+{
+	unsigned warmup = acm_warmup_blocks(acm), block, next;
+	int res;
+
+	while (1) {
+		block = acm->stream_pos / acm->block_len;
+		next = (idx->count + 1) * idx->step;
+		if ((unsigned long long)next * acm->block_len >= acm->total_values)
+			break;
+		if (block == next) {
+			/* position is unknown after EOF */
+			if (!acm->file_eof)
+				acm_index_add(acm, acm_tell_bits(acm));
+			next = (idx->count + 1) * idx->step;
+		} else if (block > next) {
+			break;
+		}
+
+		if (block < next && block + warmup >= next) {
+			res = acm_read(acm, NULL, acm->block_len * ACM_WORD, 0, ACM_WORD, 1);
+		} else {
+			res = acm_scan_block(acm);
+			acm->stream_pos += acm->block_len;
+		}
+		if (res <= 0)
+			break;
+	}
+}
+
+int acm_index_build(ACMStream *acm, unsigned interval)
+{
+	unsigned pos = acm_pcm_tell(acm);
+	struct ACMPipe *pipe = acm->pipe;
+	struct ACMIndex *idx;
+	int res;
+
+	acm_index_clear(acm);
+	if (!acm->mem_data && acm->io.seek_func == NULL)
+		return ACM_ERR_NOT_SEEKABLE;
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return ACM_ERR_OTHER;
+	if (interval == 0)
+		interval = INDEX_INTERVAL;
+	idx->step = interval * acm->info.channels / acm->block_len;
+	if (idx->step == 0)
+		idx->step = 1;
+
+	/* blocks are scanned in this thread */
+	if (pipe)
+		acm_pipe_stop(acm, 1);
+	acm->pipe = NULL;
+
+	drop_position(acm);
+	res = acm_seek_pcm(acm, 0);
+	if (res >= 0) {
+		acm->index = idx;
+		index_pass(acm, idx);
+	}
+	acm->pipe = pipe;
+	if (res >= 0) {
+		drop_position(acm);
+		res = acm_seek_pcm(acm, pos);
+	}
+	if (res < 0) {
+		acm->index = idx;
+		acm_index_clear(acm);
+		return res;
+	}
+	return ACM_OK;
+}
+
+int acm_scan(ACMStream *acm, unsigned *frames)
+{
+	unsigned pos = acm_pcm_tell(acm), values = 0;
+	struct ACMPipe *pipe = acm->pipe;
+	int res, err;
+
+	if (!acm->mem_data && acm->io.seek_func == NULL)
+		return ACM_ERR_NOT_SEEKABLE;
+
+	drop_position(acm);
+	if ((res = acm_seek_pcm(acm, 0)) < 0)
+		return res;
+
+	/* seek stopped the worker, blocks are scanned in this thread */
+	acm->pipe = NULL;
+	while (values < acm->total_values) {
+		res = acm_scan_block(acm);
+		if (res <= 0)
+			break;
+		if (acm->block_len < acm->total_values - values)
+			values += acm->block_len;
+		else
+			values = acm->total_values;
+	}
+	acm->pipe = pipe;
+	drop_position(acm);
+	err = acm_seek_pcm(acm, pos);
+
+	if (frames != NULL)
+		*frames = values / acm->info.channels;
+	if (res < 0)
+		return res;
+	if (values < acm->total_values)
+		return ACM_ERR_UNEXPECTED_EOF;
+	return err < 0 ? err : ACM_OK;
+}
+
+void acm_index_clear(ACMStream *acm)
+{
+	struct ACMIndex *idx = acm->index;
+
+	if (idx == NULL)
+		return;
+	free(idx->bit_ofs);
+	free(idx->wrap);
+	free(idx->check);
+	free(idx);
+	acm->index = NULL;
+}
+
+/*
+ * Index file
+ *
+ * Header fields are little-endian, followed by checkpoints.
+ * Each has bit offset as delta from previous one, hash of
+ * CHECK_LEN bytes at that offset, then wrapbuf values
+ * zigzag-encoded.  All are LEB128 varints.
+ */
+
+static unsigned char *put_le32(unsigned char *p, unsigned v)
+{
+	*p++ = v;
+	*p++ = v >> 8;
+	*p++ = v >> 16;
+	*p++ = v >> 24;
+	return p;
+}
+
+static unsigned get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* returns NULL if data ends */
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end,
+				       unsigned long long *v)
+{
+	unsigned shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		*v |= (unsigned long long)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+static void hash_bytes(unsigned long long *h, const unsigned char *p, unsigned len)
+{
+	unsigned i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		*h ^= p[i];
+		*h *= 0x100000001B3ULL;
+	}
+}
+
+/* hash stream with given offset and length, from memory or with io callbacks */
+static int hash_part(ACMStream *acm, unsigned long long *h, unsigned ofs, unsigned len,
+		     unsigned char *tmp)
+{
+	int res;
+
+	if (acm->mem_data) {
+		hash_bytes(h, acm->buf + ofs, len);
+		return 0;
+	}
+	if (acm->io.seek_func(acm->io_arg, ofs, SEEK_SET) < 0)
+		return ACM_ERR_NOT_SEEKABLE;
+	res = acm->io.read_func(tmp, 1, len, acm->io_arg);
+	if (res != (int)len)
+		return ACM_ERR_READ_ERR;
+	hash_bytes(h, tmp, len);
+	return 0;
+}
+
+/* put io position back where reader left it */
+static int restore_io(ACMStream *acm)
+{
+	if (acm->mem_data)
+		return 0;
+	if (acm->io.seek_func(acm->io_arg, acm->buf_start_ofs + acm->buf_size, SEEK_SET) < 0)
+		return ACM_ERR_NOT_SEEKABLE;
+	return 0;
+}
+
+/* hash of bytes at checkpoint, io position must be restored after */
+static int checkpoint_hash(ACMStream *acm, unsigned long long bit_ofs, unsigned *check)
+{
+	unsigned ofs = bit_ofs >> 3, n = 0;
+	unsigned char tmp[CHECK_LEN];
+	unsigned long long h = FNV_INIT;
+	int err;
+
+	if (ofs < acm->data_len)
+		n = acm->data_len - ofs < CHECK_LEN ? acm->data_len - ofs : CHECK_LEN;
+	if (!acm->mem_data && acm->io.seek_func == NULL)
+		return ACM_ERR_NOT_SEEKABLE;
+	err = hash_part(acm, &h, ofs, n, tmp);
+	*check = (unsigned)h;
+	return err;
+}
+
+int acm_index_check(ACMStream *acm, unsigned i)
+{
+	struct ACMIndex *idx = acm->index;
+	unsigned check;
+	int err, err2;
+
+	/* checkpoints recorded while decoding need no check */
+	if (idx == NULL || i >= idx->nchecks)
+		return 1;
+
+	/* io is used here, blocks read ahead stay valid */
+	if (!acm->mem_data && acm->pipe)
+		acm_pipe_stop(acm, 0);
+	err = checkpoint_hash(acm, idx->bit_ofs[i], &check);
+	err2 = restore_io(acm);
+	if (err < 0 || err2 < 0)
+		return err < 0 ? err : err2;
+	return check == idx->check[i];
+}
+
+/*
+ * Hash of stream size, start and end.  Catches replaced files
+ * cheaply, reading whole file would cost as much as indexing it.
+ * Edits in the middle are caught by checkpoint hashes when used.
+ */
+static int stream_hash(ACMStream *acm, unsigned long long *hash)
+{
+	unsigned len = acm->data_len, n = len < HASH_LEN ? len : HASH_LEN;
+	unsigned char *tmp = NULL, sz[4];
+	unsigned long long h = FNV_INIT;
+	int err;
+
+	if (len == 0 || (!acm->mem_data && acm->io.seek_func == NULL))
+		return ACM_ERR_NOT_SEEKABLE;
+
+	put_le32(sz, len);
+	hash_bytes(&h, sz, 4);
+
+	if (!acm->mem_data) {
+		/* io is used here, blocks read ahead stay valid */
+		if (acm->pipe)
+			acm_pipe_stop(acm, 0);
+		tmp = malloc(n);
+		if (tmp == NULL)
+			return ACM_ERR_OTHER;
+	}
+	err = hash_part(acm, &h, 0, n, tmp);
+	if (err == 0 && len > n)
+		err = hash_part(acm, &h, len - n, n, tmp);
+	free(tmp);
+
+	if (restore_io(acm) < 0 && err == 0)
+		err = ACM_ERR_NOT_SEEKABLE;
+
+	*hash = h;
+	return err;
+}
+
+int acm_index_save(ACMStream *acm, const char *filename)
+{
+	struct ACMIndex *idx = acm->index;
+	unsigned long long hash, prev = 0;
+	unsigned char *buf, *p;
+	const int *w;
+	unsigned i, j, len, check;
+	char *tmpfn;
+	FILE *f;
+	int err;
+
+	if (idx == NULL)
+		return ACM_ERR_OTHER;
+	if ((err = stream_hash(acm, &hash)) < 0)
+		return err;
+
+	/* varints take at most 10 and 5 bytes */
+	len = IDX_HDR_LEN + idx->count * (10 + 5 + acm->wrapbuf_len * 5);
+	buf = malloc(len);
+	if (buf == NULL)
+		return ACM_ERR_OTHER;
+
+	memcpy(buf, IDX_MAGIC, 4);
+	p = put_le32(buf + 4, IDX_VERSION);
+	p = put_le32(p, acm->data_len);
+	p = put_le32(p, hash);
+	p = put_le32(p, hash >> 32);
+	p = put_le32(p, acm->block_len);
+	p = put_le32(p, acm->wrapbuf_len);
+	p = put_le32(p, idx->step);
+	p = put_le32(p, idx->count);
+	p = put_le32(p, acm->total_values);
+
+	for (i = 0; i < idx->count; i++) {
+		if ((err = checkpoint_hash(acm, idx->bit_ofs[i], &check)) < 0)
+			break;
+		p = put_varint(p, idx->bit_ofs[i] - prev);
+		p = put_varint(p, check);
+		prev = idx->bit_ofs[i];
+		w = idx->wrap + i * acm->wrapbuf_len;
+		for (j = 0; j < acm->wrapbuf_len; j++)
+			p = put_varint(p, ((unsigned)w[j] << 1) ^ (unsigned)(w[j] >> 31));
+	}
+	if (restore_io(acm) < 0 && err == 0)
+		err = ACM_ERR_NOT_SEEKABLE;
+	if (err < 0) {
+		free(buf);
+		return err;
+	}
+	len = p - buf;
+
+	/* write under temporary name, so readers never see partial file */
+	tmpfn = malloc(strlen(filename) + 5);
+	if (tmpfn == NULL) {
+		free(buf);
+		return ACM_ERR_OTHER;
+	}
+	strcpy(tmpfn, filename);
+	strcat(tmpfn, ".tmp");
+
+	err = ACM_OK;
+	if ((f = fopen(tmpfn, "wb")) == NULL) {
+		err = ACM_ERR_OPEN;
+	} else {
+		if (fwrite(buf, 1, len, f) != len)
+			err = ACM_ERR_OTHER;
+		if (fclose(f) != 0)
+			err = ACM_ERR_OTHER;
+		if (err == ACM_OK && rename(tmpfn, filename) != 0)
+			err = ACM_ERR_OTHER;
+		if (err != ACM_OK)
+			remove(tmpfn);
+	}
+	free(tmpfn);
+	free(buf);
+	return err;
+}
+
+/* parse index file contents, checking it belongs to stream */
+static int parse_index(ACMStream *acm, const unsigned char *buf, unsigned len,
+		       struct ACMIndex *idx)
+{
+	const unsigned char *p = buf + IDX_HDR_LEN, *end = buf + len;
+	unsigned long long hash, v, ofs = 0;
+	unsigned i, j;
+	int err;
+
+	if (len < IDX_HDR_LEN || memcmp(buf, IDX_MAGIC, 4) != 0
+	    || get_le32(buf + 4) != IDX_VERSION)
+		return ACM_ERR_BADFMT;
+
+	/* stream must be same */
+	if ((err = stream_hash(acm, &hash)) < 0)
+		return err;
+	if (get_le32(buf + 8) != acm->data_len
+	    || get_le32(buf + 12) != (unsigned)hash
+	    || get_le32(buf + 16) != (unsigned)(hash >> 32)
+	    || get_le32(buf + 20) != acm->block_len
+	    || get_le32(buf + 24) != acm->wrapbuf_len
+	    || get_le32(buf + 36) != acm->total_values)
+		return ACM_ERR_BADFMT;
+
+	idx->step = get_le32(buf + 28);
+	idx->count = get_le32(buf + 32);
+	if (idx->step == 0 || idx->count > len)
+		return ACM_ERR_BADFMT;
+	idx->max = idx->count;
+	if (idx->count == 0)
+		return 0;
+
+	idx->bit_ofs = malloc(idx->count * sizeof(*idx->bit_ofs));
+	idx->check = malloc(idx->count * sizeof(*idx->check));
+	if (acm->wrapbuf_len > 0)
+		idx->wrap = malloc(idx->count * acm->wrapbuf_len * sizeof(int));
+	if (idx->bit_ofs == NULL || idx->check == NULL
+	    || (acm->wrapbuf_len > 0 && idx->wrap == NULL))
+		return ACM_ERR_OTHER;
+	idx->nchecks = idx->count;
+
+	for (i = 0; i < idx->count; i++) {
+		if ((p = get_varint(p, end, &v)) == NULL)
+			return ACM_ERR_BADFMT;
+		ofs += v;
+		if (ofs > (unsigned long long)acm->data_len * 8)
+			return ACM_ERR_BADFMT;
+		idx->bit_ofs[i] = ofs;
+		if ((p = get_varint(p, end, &v)) == NULL || v > 0xFFFFFFFFU)
+			return ACM_ERR_BADFMT;
+		idx->check[i] = v;
+		for (j = 0; j < acm->wrapbuf_len; j++) {
+			if ((p = get_varint(p, end, &v)) == NULL)
+				return ACM_ERR_BADFMT;
+			idx->wrap[i * acm->wrapbuf_len + j] = (int)((v >> 1) ^ -(v & 1));
+		}
+	}
+	return 0;
+}
+
+int acm_index_load(ACMStream *acm, const char *filename)
+{
+	struct ACMIndex *idx;
+	unsigned char *buf;
+	long len;
+	FILE *f;
+	int err;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+		return ACM_ERR_OPEN;
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return ACM_ERR_READ_ERR;
+	}
+	buf = malloc(len > 0 ? len : 1);
+	if (buf == NULL) {
+		fclose(f);
+		return ACM_ERR_OTHER;
+	}
+	if (fread(buf, 1, len, f) != (size_t)len) {
+		fclose(f);
+		free(buf);
+		return ACM_ERR_READ_ERR;
+	}
+	fclose(f);
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL) {
+		free(buf);
+		return ACM_ERR_OTHER;
+	}
+	err = parse_index(acm, buf, len, idx);
+	free(buf);
+	if (err < 0) {
+		free(idx->bit_ofs);
+		free(idx->wrap);
+		free(idx->check);
+		free(idx);
+		return err;
+	}
+	acm_index_clear(acm);
+	acm->index = idx;
+	return ACM_OK;
+}
@@ -0,0 +1,67 @@
+/*
+ * Seek index for libacm, internal API.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ACM_INDEX_H
+#define __ACM_INDEX_H
+
+/*
+ * Checkpoint "i" is decoder state at start of block (i + 1) * step,
+ * start of stream needs no checkpoint.  It is bit position of
+ * block header and wrapbuf contents from previous block.
+ */
+struct ACMIndex {
+	unsigned step;			/* blocks between checkpoints */
+	unsigned count, max;		/* checkpoints recorded and allocated */
+	unsigned long long *bit_ofs;	/* absolute bit offset in file */
+	int *wrap;			/* wrapbuf_len values for each checkpoint */
+	unsigned *check;		/* hash of bytes at bit_ofs, for loaded ones */
+	unsigned nchecks;		/* checkpoints that have check */
+};
+
+/* decode.c: move bit reader to absolute bit offset */
+int acm_seek_bits(ACMStream *acm, unsigned long long bit_ofs);
+
+/* decode.c: current bit offset, reader must not be at EOF */
+unsigned long long acm_tell_bits(ACMStream *acm);
+
+/* decode.c: parse next block, returns 1, 0 on EOF or ACM_ERR_* */
+int acm_scan_block(ACMStream *acm);
+
+/* decode.c: read block header and values, returns 1, 0 on EOF or ACM_ERR_* */
+int acm_read_block(ACMStream *acm, int *block);
+
+/* decode.c: bytes per sample, 0 if format is not supported */
+unsigned acm_sample_size(int wordlen);
+
+/* blocks to decode before wrapbuf is same as when decoding from start */
+unsigned acm_warmup_blocks(ACMStream *acm);
+
+/* record checkpoint if block at stream_pos is due for one, "bit_ofs" is its start */
+void acm_index_add(ACMStream *acm, unsigned long long bit_ofs);
+
+/*
+ * Restore checkpoint nearest before "word_pos", if it is closer
+ * than current position.  Index is dropped if checkpoint does
+ * not match the stream.  returns 1 if restored, 0 if not, or ACM_ERR_*
+ */
+int acm_index_seek(ACMStream *acm, unsigned word_pos);
+
+/* returns 1 if checkpoint "i" matches stream, 0 if not, or ACM_ERR_* */
+int acm_index_check(ACMStream *acm, unsigned i);
+
+#endif
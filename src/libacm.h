@@ -38,6 +38,20 @@ extern "C" {
 #define ACM_ERR_UNEXPECTED_EOF	-7
 #define ACM_ERR_NOT_SEEKABLE	-8
 
+/* acm_read() wordlen for 32-bit float samples */
+#define ACM_FLOAT32		-4
+
+/* appended to ACM filename for seek index file */
+#define ACM_INDEX_SUFFIX	".idx"
+
+/* acm_set_gain() value for unchanged volume */
+#define ACM_GAIN_UNITY		0x10000
+
+#define ACM_SIMD_AUTO		-1
+#define ACM_SIMD_NONE		 0
+#define ACM_SIMD_SSE2		 1
+#define ACM_SIMD_AVX2		 2
+
 typedef struct ACMInfo {
 	unsigned channels;		/* number of sound channels (1: mono, 2: stereo */
 	unsigned rate;			/* samplerate */
@@ -68,6 +82,10 @@ typedef struct {
 	int (*get_length_func)(void *datasrc);
 } acm_io_callbacks;
 
+struct ACMResampler;
+struct ACMIndex;
+struct ACMPipe;
+
 struct ACMStream {
 	ACMInfo info;
 	unsigned total_values;		/* number of sound samples in the ACM file */
@@ -80,23 +98,43 @@ struct ACMStream {
 	/* acm stream buffer */
 	unsigned char *buf;
 	unsigned buf_max, buf_size, buf_pos, bit_avail;
-	unsigned bit_data;
+	unsigned long long bit_data;
 	unsigned buf_start_ofs;
 
 	/* block lengths (in samples) */
 	unsigned block_len;
 	unsigned wrapbuf_len;
+	/* bytes needed in buffer for unchecked decoding of column */
+	unsigned fast_len[32];
 	/* buffers */
 	int *block;
+	int *colbuf;			/* column-major scratch for fillers */
 	int *wrapbuf;
-	int *ampbuf;
-	int *midbuf;			/* pointer into ampbuf */
+	unsigned block_amp;		/* sample step of current block */
+	int simd;			/* ACM_SIMD_* level, fixed at open */
 	/* result */
-	unsigned block_ready:1;
-	unsigned file_eof:1;
+	/* not bitfields, file_eof is set by pipeline thread */
+	unsigned block_ready;
+	unsigned file_eof;
 	unsigned wavc_file:1;
+	unsigned mem_data:1;			/* buf points to caller data */
 	unsigned stream_pos;			/* in words. absolute */
 	unsigned block_pos;			/* in words, relative */
+
+	/* output stage, used if output differs from decoded stream */
+	unsigned out_rate, out_chans;		/* requested output, 0 rate is no resampling */
+	struct ACMResampler *resampler;
+	float gain, gain_target;		/* 1.0 is unity */
+	unsigned fade_left;			/* frames until gain_target */
+	int *outbuf;				/* processed values */
+	unsigned out_pos, out_len;		/* in words, relative */
+	unsigned out_src_pos;			/* stream_pos outbuf continues from */
+
+	/* seek checkpoints, NULL if no index */
+	struct ACMIndex *index;
+
+	/* read-ahead thread, NULL if not used */
+	struct ACMPipe *pipe;
 };
 typedef struct ACMStream ACMStream;
 
@@ -119,12 +157,29 @@ typedef struct ACMStream ACMStream;
  */
 int acm_open_decoder(ACMStream **res, void *io_arg, acm_io_callbacks io, int force_chans);
 
+/*
+ * Open ACMStream from ACM file contents in memory.
+ * - res: if opening the decoder succeeds, the new ACMStream will be assigned to *res
+ * - data, len: file contents, must stay valid and unchanged until acm_close()
+ * - force_chans: same as for acm_open_decoder()
+ *
+ * The data is decoded in place, without copying.  The stream is seekable.
+ *
+ * returns ACM_OK if opening was successful, otherwise an ACM_ERR_* code
+ */
+int acm_open_memory(ACMStream **res, const void *data, unsigned len, int force_chans);
+
 /*
  * Read up to "nbytes" bytes of audio samples from ACMStream "acm" into buffer "buf".
  * "bigendianp", "wordlen" and "sgned" specify the format you want the returned samples
  * to have, for example 0, 2, 1 for "little endian, 16bit (2byte), signed" (s16le).
  * - bigendianp: 0 for samples in little endian byteorder, 1 for big endian
- * - wordlen: only 2 for 16bit (2byte) samples is currently supported
+ * - wordlen: 2, 3 or 4 for 16, 24 or 32bit samples, or ACM_FLOAT32 for
+ *   float samples in host byteorder.  For floats "bigendianp" and
+ *   "sgned" are ignored, 16-bit full scale is 1.0 and values are not
+ *   clamped, also with gain, so loud streams can go beyond [-1, 1).
+ *   Samples wider than 16 bits keep the extra precision and saturate
+ *   when out of range.
  * - sgned: 1 for signed samples, 0 for unsigned samples
  *
  * returns the amount of bytes have been successfully read into buf
@@ -133,8 +188,132 @@ int acm_open_decoder(ACMStream **res, void *io_arg, acm_io_callbacks io, int for
  */
 int acm_read(ACMStream *acm, void *buf, unsigned nbytes,
 		int bigendianp, int wordlen, int sgned);
+
+/*
+ * Read "nframes" frames (samples for each channel) into buffer "dst".
+ * Frame has number of channels set with acm_set_channels(), by default
+ * acm_channels().  Format arguments are same as for acm_read().
+ *
+ * Whole blocks are decoded and converted straight into "dst",
+ * so this is fastest with large buffers.
+ *
+ * returns the number of frames read, less than "nframes" only at EOF
+ *   or a value < 0 (ACM_ERR_*) on error
+ */
+int acm_read_frames(ACMStream *acm, void *dst, unsigned nframes,
+		int bigendianp, int wordlen, int sgned);
+
+/*
+ * Read up to "nframes" frames into separate buffer for each channel.
+ * - dst: array of buffers, one for each channel set with acm_set_channels()
+ *   (by default acm_channels()), each with room for "nframes" samples
+ * - bigendianp, wordlen, sgned: as for acm_read(), wordlen can be 2 or ACM_FLOAT32
+ *
+ * Reads across blocks, so result is less than "nframes" only at EOF.
+ *
+ * returns the number of frames read into each buffer
+ *   or 0 on EOF
+ *   or a value < 0 (ACM_ERR_*) on error
+ */
+int acm_read_planar(ACMStream *acm, void **dst, unsigned nframes,
+		int bigendianp, int wordlen, int sgned);
+
+/*
+ * Read up to "maxframes" frames without format conversion.
+ * "*values" is set to point at interleaved int samples, 16-bit sample
+ * value is (value >> acm_level).  Output stage settings are applied,
+ * frames have number of channels set with acm_set_channels().
+ * The values stay valid until next read from the stream.
+ *
+ * returns the number of frames
+ *   or 0 on EOF
+ *   or a value < 0 (ACM_ERR_*) on error
+ */
+int acm_read_values(ACMStream *acm, int **values, unsigned maxframes);
 void acm_close(ACMStream *acm);
 
+/*
+ * Resample output to "rate", using polyphase filter.
+ * Call after opening, before reading.  Positions and acm_rate()
+ * still refer to the file's samplerate.
+ * - rate: output samplerate, file's own rate turns resampling off
+ *
+ * returns ACM_OK, or ACM_ERR_BADFMT if rate ratio is not supported
+ */
+int acm_set_rate(ACMStream *acm, unsigned rate);
+
+/*
+ * Remix output to "chans" channels: mono is duplicated into
+ * both stereo channels, stereo is downmixed to average of channels.
+ * Call after opening, before reading.  acm_channels() still returns
+ * the file's channel count.
+ * - chans: 1 or 2, file's own channel count turns remix off
+ *
+ * returns ACM_OK, or ACM_ERR_BADFMT if remix is not supported
+ */
+int acm_set_channels(ACMStream *acm, unsigned chans);
+
+/*
+ * Set output volume, can be called between reads.  Scaled samples
+ * are rounded to nearest, integer formats saturate at their range
+ * and float samples are not clamped.  Stops fade in progress.
+ * - gain: multiplier, ACM_GAIN_UNITY means unchanged
+ *
+ * returns ACM_OK
+ */
+int acm_set_gain(ACMStream *acm, unsigned gain);
+
+/*
+ * Change gain linearly from current value to "gain" over
+ * next "nframes" output frames.
+ *
+ * returns ACM_OK
+ */
+int acm_fade(ACMStream *acm, unsigned gain, unsigned nframes);
+
+/*
+ * Decode in two threads: a worker thread parses blocks ahead,
+ * while the reading thread juggles and converts them.  Stream must
+ * still be used from one thread at a time.
+ * - enable: 1 to start pipelined decoding, 0 to go back to single thread
+ *
+ * returns ACM_OK, or ACM_ERR_OTHER if threads are not available
+ */
+int acm_set_pipeline(ACMStream *acm, int enable);
+
+/*
+ * Decode whole stream in "nthreads" threads into "dst".  Stream is split
+ * into segments at index checkpoints, or at block positions found
+ * by parsing the stream without decoding if there is no index.  Each thread decodes
+ * segments with its own decoder, into its own part of "dst".
+ * - dst: room for "nframes" frames of acm->info.channels samples
+ * - bigendianp, wordlen, sgned: as for acm_read()
+ *
+ * Stream must be opened with acm_open_memory() or acm_open_file() on
+ * regular file.  Output stage is not used and stream position is
+ * not changed.  Contents of "dst" after returned frames are undefined.
+ *
+ * returns the number of frames decoded, less than "nframes" only at EOF
+ *   or a value < 0 (ACM_ERR_*) on error
+ */
+int acm_decode_parallel(ACMStream *acm, void *dst, unsigned nframes,
+		int bigendianp, int wordlen, int sgned, int nthreads);
+
+/*
+ * Select SIMD code used by decoder, for streams opened after the call.
+ * Already open streams keep their level.  Call it before streams are
+ * opened in other threads, it is not synchronized with them.
+ * By default best one supported by CPU is used, ACM_SIMD_NONE
+ * forces plain C code, which is useful for testing.
+ * - level: ACM_SIMD_* value, levels not supported by CPU are lowered
+ *
+ * returns the level that will be used
+ */
+int acm_set_simd(int level);
+
+/* returns the SIMD level new streams will use */
+int acm_get_simd(void);
+
 /* util.c */
 
 /*
@@ -149,6 +328,11 @@ void acm_close(ACMStream *acm);
  * - force_chans == -1: quirk mode: for plain ACM files stereo
  *   is assumed, for WAVC files the header's value is used
  *
+ * Regular files are mapped into memory, others are read with stdio.
+ * A mapped file must not be truncated while the stream is open:
+ * reading the missing part kills the process with SIGBUS, instead
+ * of giving ACM_ERR_UNEXPECTED_EOF.
+ *
  * returns ACM_OK if opening was successful, otherwise an ACM_ERR_* code
  */
 int acm_open_file(ACMStream **acm, const char *filename, int force_chans);
@@ -169,6 +353,99 @@ int acm_seek_pcm(ACMStream *acm, unsigned pcm_pos);
 int acm_seek_time(ACMStream *acm, unsigned pos_ms);
 const char *acm_strerror(int err);
 
+/* index.c */
+
+/*
+ * Build seek index by decoding the whole stream once.  Decoder state
+ * is recorded after every "interval" frames, so acm_seek_pcm()
+ * decodes at most that many frames before reaching the target.
+ * - interval: frames between checkpoints, 0 for default of 8192
+ *
+ * Stream position is kept.  Stream must be seekable.
+ *
+ * returns ACM_OK or ACM_ERR_* code
+ */
+int acm_index_build(ACMStream *acm, unsigned interval);
+
+/* free seek index */
+void acm_index_clear(ACMStream *acm);
+
+/*
+ * Parse whole stream without decoding it, to check it
+ * or find its real length.  Stream position is kept.
+ * - frames: if not NULL, set to number of frames in complete blocks
+ *
+ * returns ACM_OK if stream has as many samples as its header says,
+ *   ACM_ERR_UNEXPECTED_EOF if it ends early, or other ACM_ERR_* code
+ */
+int acm_scan(ACMStream *acm, unsigned *frames);
+
+/*
+ * Write seek index into file, so it can be loaded instead
+ * of being built again.  acm_open_file() loads index from
+ * file with ACM_INDEX_SUFFIX appended to the ACM filename, if it exists.
+ *
+ * returns ACM_OK or ACM_ERR_* code
+ */
+int acm_index_save(ACMStream *acm, const char *filename);
+
+/*
+ * Load seek index from file.  Index file records size of the stream
+ * and hashes of its start and end, it is not loaded if they differ.
+ * Other changes are found when checkpoint is used for seeking, each
+ * has hash of few bytes at its position.  Then index is dropped and
+ * seeking decodes from start.  Checks are heuristic, an edit that
+ * keeps those bytes is not noticed.
+ *
+ * returns ACM_OK, ACM_ERR_OPEN if there is no file,
+ *   ACM_ERR_BADFMT if it does not match the stream, or other ACM_ERR_* code
+ */
+int acm_index_load(ACMStream *acm, const char *filename);
+
+/* mixer.c */
+
+typedef struct ACMMixer ACMMixer;
+
+/*
+ * Create mixer that outputs "chans" channels (1 or 2) at samplerate "rate".
+ *
+ * returns new mixer, or NULL on error
+ */
+ACMMixer *acm_mixer_new(unsigned rate, unsigned chans);
+
+/* free mixer and close all streams in it */
+void acm_mixer_free(ACMMixer *mix);
+
+/*
+ * Add stream to mixer, mixer takes ownership of the stream
+ * and closes it when it ends or is removed.
+ * Stream is resampled to mixer rate if needed.
+ * - gain: volume, ACM_GAIN_UNITY means unchanged
+ * - pan: -ACM_GAIN_UNITY is left, 0 is center, ACM_GAIN_UNITY is right
+ * - loop: if nonzero, stream is restarted from beginning at end
+ *
+ * returns voice id >= 0, or ACM_ERR_* code
+ */
+int acm_mixer_add(ACMMixer *mix, ACMStream *acm, unsigned gain, int pan, int loop);
+
+/* change gain and pan of voice, returns ACM_OK or ACM_ERR_* code */
+int acm_mixer_set(ACMMixer *mix, int voice, unsigned gain, int pan);
+
+/* remove voice and close its stream, returns ACM_OK or ACM_ERR_* code */
+int acm_mixer_remove(ACMMixer *mix, int voice);
+
+/* returns 1 if voice is still playing */
+int acm_mixer_active(ACMMixer *mix, int voice);
+
+/*
+ * Mix "nframes" frames into "dst".  Voices that have ended give silence.
+ * - bigendianp, wordlen, sgned: as for acm_read(), wordlen can be 2 or ACM_FLOAT32
+ *
+ * returns "nframes", or ACM_ERR_* code
+ */
+int acm_mixer_read(ACMMixer *mix, void *dst, unsigned nframes,
+		   int bigendianp, int wordlen, int sgned);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
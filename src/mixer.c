@@ -0,0 +1,360 @@
+/*
+ * Mixer for several ACM streams.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "libacm.h"
+
+/*
+ * Frames mixed at once.  All voices are added into the bus
+ * before it is converted, so it should stay in L1.
+ */
+#define MIX_FRAMES	512
+
+struct MixVoice {
+	ACMStream *acm;			/* NULL if slot is free */
+	unsigned gain;
+	int pan;
+	int loop;
+	float gl, gr;			/* gain for left and right, with sample scale */
+};
+
+struct ACMMixer {
+	unsigned rate, chans;
+	int simd;
+	struct MixVoice *voice;
+	unsigned voice_max;
+	float bus[MIX_FRAMES * 2];
+};
+
+/*
+ * Adding into bus.  Stereo into mono bus is average of channels,
+ * mono into stereo bus goes to both channels.
+ */
+
+static void mix_values(float *bus, unsigned bus_chans, const int *src, unsigned chans,
+		       unsigned n, float gl, float gr)
+{
+	unsigned i;
+	float l, r;
+
+	for (i = 0; i < n; i++) {
+		if (chans == 1) {
+			l = src[i] * gl;
+			r = src[i] * gr;
+		} else {
+			l = src[i*2] * gl;
+			r = src[i*2 + 1] * gr;
+		}
+		if (bus_chans == 1) {
+			bus[i] += chans == 1 ? l : (l + r) * 0.5f;
+		} else {
+			bus[i*2] += l;
+			bus[i*2 + 1] += r;
+		}
+	}
+}
+
+#ifdef __SSE2__
+
+static void mix_values_sse2(float *bus, unsigned bus_chans, const int *src, unsigned chans,
+			    unsigned n, float gl, float gr)
+{
+	const __m128 g = (bus_chans == 1 && chans == 1) ? _mm_set1_ps(gl)
+		: _mm_setr_ps(gl, gr, gl, gr);
+	__m128 a, b;
+	unsigned i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		if (chans == bus_chans) {
+			/* same layout, 4 values */
+			a = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(src + i*chans)));
+			a = _mm_add_ps(_mm_loadu_ps(bus + i*chans), _mm_mul_ps(a, g));
+			_mm_storeu_ps(bus + i*chans, a);
+			if (chans == 2) {
+				b = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(src + i*2 + 4)));
+				b = _mm_add_ps(_mm_loadu_ps(bus + i*2 + 4), _mm_mul_ps(b, g));
+				_mm_storeu_ps(bus + i*2 + 4, b);
+			}
+		} else if (chans == 1) {
+			/* mono into stereo */
+			a = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(src + i)));
+			b = _mm_mul_ps(_mm_unpackhi_ps(a, a), g);
+			a = _mm_mul_ps(_mm_unpacklo_ps(a, a), g);
+			_mm_storeu_ps(bus + i*2, _mm_add_ps(_mm_loadu_ps(bus + i*2), a));
+			_mm_storeu_ps(bus + i*2 + 4, _mm_add_ps(_mm_loadu_ps(bus + i*2 + 4), b));
+		} else {
+			/* stereo into mono */
+			a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(src + i*2))), g);
+			b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(src + i*2 + 4))), g);
+			a = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+				       _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+			a = _mm_mul_ps(a, _mm_set1_ps(0.5f));
+			_mm_storeu_ps(bus + i, _mm_add_ps(_mm_loadu_ps(bus + i), a));
+		}
+	}
+	mix_values(bus + i*bus_chans, bus_chans, src + i*chans, chans, n - i, gl, gr);
+}
+
+#endif /* __SSE2__ */
+
+/*
+ * Bus output, 1.0 is 16-bit full scale.
+ */
+
+static void out_bus_16(const float *bus, unsigned char *dst, unsigned n,
+		       int bigendianp, unsigned bias)
+{
+	unsigned i, val;
+	float x;
+
+	for (i = 0; i < n; i++) {
+		x = bus[i] * 32768.0f;
+		if (x > 32767.0f)
+			x = 32767.0f;
+		else if (x < -32768.0f)
+			x = -32768.0f;
+		val = (lrintf(x) & 0xFFFF) ^ bias;
+		if (bigendianp) {
+			*dst++ = val >> 8;
+			*dst++ = val & 0xFF;
+		} else {
+			*dst++ = val & 0xFF;
+			*dst++ = val >> 8;
+		}
+	}
+}
+
+#ifdef __SSE2__
+
+/* 8 values per loop, clamped like out_bus_16() before conversion */
+static void out_bus_16_sse2(const float *bus, unsigned char *dst, unsigned n,
+			    int bigendianp, unsigned bias)
+{
+	const __m128 scale = _mm_set1_ps(32768.0f);
+	const __m128 hi = _mm_set1_ps(32767.0f), lo = _mm_set1_ps(-32768.0f);
+	const __m128i xbias = _mm_set1_epi16(bias);
+	__m128 x, y;
+	__m128i a, b;
+	unsigned i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm_mul_ps(_mm_loadu_ps(bus + i), scale);
+		y = _mm_mul_ps(_mm_loadu_ps(bus + i + 4), scale);
+		a = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(x, hi), lo));
+		b = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(y, hi), lo));
+		a = _mm_xor_si128(_mm_packs_epi32(a, b), xbias);
+		if (bigendianp)
+			a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		_mm_storeu_si128((__m128i *)(dst + i*2), a);
+	}
+	out_bus_16(bus + i, dst + i*2, n - i, bigendianp, bias);
+}
+
+#endif /* __SSE2__ */
+
+static void voice_gain(struct MixVoice *v)
+{
+	float g = (float)v->gain / ACM_GAIN_UNITY;
+	float pan = (float)v->pan / ACM_GAIN_UNITY;
+
+	/* ints to bus scale */
+	g /= (float)(0x8000 << v->acm->info.acm_level);
+	v->gl = pan > 0 ? g * (1.0f - pan) : g;
+	v->gr = pan < 0 ? g * (1.0f + pan) : g;
+}
+
+static void drop_voice(struct MixVoice *v)
+{
+	acm_close(v->acm);
+	v->acm = NULL;
+}
+
+/* add "n" frames of voice into bus */
+static void mix_voice(ACMMixer *mix, struct MixVoice *v, unsigned n)
+{
+	void (*fn)(float *bus, unsigned bus_chans, const int *src, unsigned chans,
+		   unsigned n, float gl, float gr) = mix_values;
+	unsigned chans = v->acm->out_chans, done = 0;
+	int *src, got, rewound = 0;
+
+#ifdef __SSE2__
+	if (mix->simd >= ACM_SIMD_SSE2)
+		fn = mix_values_sse2;
+#endif
+
+	while (done < n) {
+		got = acm_read_values(v->acm, &src, n - done);
+		if (got > 0) {
+			fn(mix->bus + done * mix->chans, mix->chans, src, chans, got, v->gl, v->gr);
+			done += got;
+			rewound = 0;
+			continue;
+		}
+		/* at end, or error */
+		if (got == 0 && v->loop && !rewound && acm_seek_pcm(v->acm, 0) == 0) {
+			rewound = 1;
+			continue;
+		}
+		drop_voice(v);
+		break;
+	}
+}
+
+ACMMixer *acm_mixer_new(unsigned rate, unsigned chans)
+{
+	ACMMixer *mix;
+
+	if (rate == 0 || chans < 1 || chans > 2)
+		return NULL;
+	mix = calloc(1, sizeof(*mix));
+	if (mix == NULL)
+		return NULL;
+	mix->rate = rate;
+	mix->chans = chans;
+	mix->simd = acm_get_simd();
+	return mix;
+}
+
+void acm_mixer_free(ACMMixer *mix)
+{
+	unsigned i;
+
+	if (mix == NULL)
+		return;
+	for (i = 0; i < mix->voice_max; i++) {
+		if (mix->voice[i].acm)
+			drop_voice(&mix->voice[i]);
+	}
+	free(mix->voice);
+	free(mix);
+}
+
+int acm_mixer_add(ACMMixer *mix, ACMStream *acm, unsigned gain, int pan, int loop)
+{
+	struct MixVoice *v, *tmp;
+	unsigned i;
+	int err;
+
+	if (acm->out_chans > 2)
+		return ACM_ERR_BADFMT;
+	if ((err = acm_set_rate(acm, mix->rate)) < 0)
+		return err;
+
+	for (i = 0; i < mix->voice_max; i++) {
+		if (mix->voice[i].acm == NULL)
+			break;
+	}
+	if (i == mix->voice_max) {
+		tmp = realloc(mix->voice, (mix->voice_max * 2 + 4) * sizeof(*tmp));
+		if (tmp == NULL)
+			return ACM_ERR_OTHER;
+		mix->voice = tmp;
+		memset(tmp + mix->voice_max, 0, (mix->voice_max + 4) * sizeof(*tmp));
+		mix->voice_max = mix->voice_max * 2 + 4;
+	}
+
+	v = &mix->voice[i];
+	v->acm = acm;
+	v->loop = loop;
+	acm_mixer_set(mix, i, gain, pan);
+	return i;
+}
+
+int acm_mixer_set(ACMMixer *mix, int voice, unsigned gain, int pan)
+{
+	struct MixVoice *v;
+
+	if (voice < 0 || (unsigned)voice >= mix->voice_max || mix->voice[voice].acm == NULL)
+		return ACM_ERR_OTHER;
+	v = &mix->voice[voice];
+	if (pan > ACM_GAIN_UNITY)
+		pan = ACM_GAIN_UNITY;
+	else if (pan < -ACM_GAIN_UNITY)
+		pan = -ACM_GAIN_UNITY;
+	v->gain = gain;
+	v->pan = pan;
+	voice_gain(v);
+	return ACM_OK;
+}
+
+int acm_mixer_remove(ACMMixer *mix, int voice)
+{
+	if (voice < 0 || (unsigned)voice >= mix->voice_max || mix->voice[voice].acm == NULL)
+		return ACM_ERR_OTHER;
+	drop_voice(&mix->voice[voice]);
+	return ACM_OK;
+}
+
+int acm_mixer_active(ACMMixer *mix, int voice)
+{
+	if (voice < 0 || (unsigned)voice >= mix->voice_max)
+		return 0;
+	return mix->voice[voice].acm != NULL;
+}
+
+int acm_mixer_read(ACMMixer *mix, void *dst, unsigned nframes,
+		   int bigendianp, int wordlen, int sgned)
+{
+	unsigned char *p = dst;
+	unsigned done, n, i, size;
+
+	if (wordlen == 2)
+		size = 2;
+	else if (wordlen == ACM_FLOAT32)
+		size = 4;
+	else
+		return ACM_ERR_BADFMT;
+
+	for (done = 0; done < nframes; done += n) {
+		n = nframes - done;
+		if (n > MIX_FRAMES)
+			n = MIX_FRAMES;
+
+		memset(mix->bus, 0, n * mix->chans * sizeof(float));
+		for (i = 0; i < mix->voice_max; i++) {
+			if (mix->voice[i].acm)
+				mix_voice(mix, &mix->voice[i], n);
+		}
+
+		if (wordlen == ACM_FLOAT32) {
+			memcpy(p, mix->bus, n * mix->chans * sizeof(float));
+		} else {
+#ifdef __SSE2__
+			if (mix->simd >= ACM_SIMD_SSE2)
+				out_bus_16_sse2(mix->bus, p, n * mix->chans, bigendianp,
+						sgned ? 0 : 0x8000);
+			else
+#endif
+				out_bus_16(mix->bus, p, n * mix->chans, bigendianp,
+					   sgned ? 0 : 0x8000);
+		}
+		p += n * mix->chans * size;
+	}
+	return nframes;
+}
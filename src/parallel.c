@@ -0,0 +1,283 @@
+/*
+ * Parallel decoding of whole stream for libacm.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "libacm.h"
+#include "index.h"
+
+/* segments for each thread, so threads that finish early get more */
+#define SEGS_PER_THREAD	4
+
+/*
+ * Part of stream decoded by one thread.  Decoding starts "skip"
+ * values before "start", from block header at "bit_ofs".
+ */
+struct Segment {
+	unsigned start, end;		/* in words */
+	unsigned skip;			/* values decoded only to fill wrapbuf */
+	unsigned long long bit_ofs;
+	const int *wrap;		/* checkpoint wrapbuf, NULL for zeros */
+	int res;			/* frames, or ACM_ERR_* */
+};
+
+struct ParJob {
+	ACMStream *acm;
+	unsigned char *dst;
+	int bigendianp, wordlen, sgned;
+	struct Segment *seg;
+	unsigned nseg, next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+};
+
+/*
+ * Segments start at checkpoints if there is an index.  Otherwise block
+ * positions are found by parsing the stream, and each segment
+ * is decoded from a few blocks before its start.
+ *
+ * returns number of segments, less than "nseg" if stream ends early
+ */
+static int plan_segments(ACMStream *acm, struct Segment *seg,
+			 unsigned nseg, unsigned nblocks)
+{
+	struct ACMIndex *idx = acm->index;
+	unsigned warmup = acm_warmup_blocks(acm);
+	unsigned k, i, n = 0, block = 0, target, first;
+	ACMStream *s;
+	int res;
+
+	/* own reader, it starts at block 0 */
+	res = acm_open_memory(&s, acm->buf, acm->buf_size, acm->info.channels);
+	if (res < 0)
+		return res;
+
+	for (k = 0; k < nseg; k++) {
+		target = (unsigned long long)nblocks * k / nseg;
+		i = 0;
+		if (idx != NULL) {
+			/* checkpoint i - 1 is at block i * step */
+			i = target / idx->step;
+			if (i > idx->count)
+				i = idx->count;
+			target = i * idx->step;
+		}
+		if (n > 0 && seg[n - 1].start == target * acm->block_len)
+			continue;
+
+		seg[n].start = target * acm->block_len;
+		if (i > 0) {
+			seg[n].skip = 0;
+			seg[n].bit_ofs = idx->bit_ofs[i - 1];
+			seg[n].wrap = idx->wrap + (i - 1) * acm->wrapbuf_len;
+		} else {
+			first = target > warmup ? target - warmup : 0;
+			for (res = 1; block < first && res > 0; block++)
+				res = acm_scan_block(s);
+			if (block < first || res <= 0 || s->file_eof)
+				break;
+			seg[n].skip = (target - first) * acm->block_len;
+			seg[n].bit_ofs = acm_tell_bits(s);
+			seg[n].wrap = NULL;
+		}
+		n++;
+	}
+	acm_close(s);
+	return n;
+}
+
+static struct Segment *next_segment(struct ParJob *job)
+{
+	struct Segment *seg = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&job->lock);
+#endif
+	if (job->next < job->nseg)
+		seg = &job->seg[job->next++];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&job->lock);
+#endif
+	return seg;
+}
+
+static int decode_segment(ACMStream *w, struct ParJob *job, struct Segment *seg)
+{
+	unsigned size = acm_sample_size(job->wordlen);
+	unsigned chans = w->info.channels;
+	int res;
+
+	if ((res = acm_seek_bits(w, seg->bit_ofs)) < 0)
+		return res;
+	if (seg->wrap)
+		memcpy(w->wrapbuf, seg->wrap, w->wrapbuf_len * sizeof(int));
+	else
+		memset(w->wrapbuf, 0, w->wrapbuf_len * sizeof(int));
+	w->stream_pos = seg->start - seg->skip;
+	w->block_pos = 0;
+	w->block_ready = 0;
+
+	/* warm-up values are not output */
+	while (w->stream_pos < seg->start) {
+		res = acm_read(w, NULL, (seg->start - w->stream_pos) * ACM_WORD,
+			       0, ACM_WORD, 1);
+		if (res <= 0)
+			return res < 0 ? res : ACM_ERR_UNEXPECTED_EOF;
+	}
+
+	return acm_read_frames(w, job->dst + seg->start * size,
+			       (seg->end - seg->start) / chans,
+			       job->bigendianp, job->wordlen, job->sgned);
+}
+
+/* each thread decodes with own stream on same data */
+static void run_segments(struct ParJob *job)
+{
+	ACMStream *acm = job->acm, *w;
+	struct Segment *seg;
+
+	if (acm_open_memory(&w, acm->buf, acm->buf_size, acm->info.channels) < 0)
+		return;
+	w->simd = acm->simd;
+	while ((seg = next_segment(job)) != NULL)
+		seg->res = decode_segment(w, job, seg);
+	acm_close(w);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *par_worker(void *arg)
+{
+	run_segments(arg);
+	return NULL;
+}
+
+static void run_threads(struct ParJob *job, int nthreads)
+{
+	pthread_t *tid = NULL;
+	int i, n = 0;
+
+	pthread_mutex_init(&job->lock, NULL);
+	if (nthreads > 1)
+		tid = malloc((nthreads - 1) * sizeof(*tid));
+	for (i = 0; tid != NULL && i < nthreads - 1; i++) {
+		if (pthread_create(&tid[n], NULL, par_worker, job) == 0)
+			n++;
+	}
+
+	/* calling thread works too, and does all if threads fail */
+	run_segments(job);
+
+	for (i = 0; i < n; i++)
+		pthread_join(tid[i], NULL);
+	free(tid);
+	pthread_mutex_destroy(&job->lock);
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+static void run_threads(struct ParJob *job, int nthreads)
+{
+	run_segments(job);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+int acm_decode_parallel(ACMStream *acm, void *dst, unsigned nframes,
+		int bigendianp, int wordlen, int sgned, int nthreads)
+{
+	unsigned chans = acm->info.channels, end, nblocks, nseg, i;
+	struct ParJob job;
+	struct Segment *seg;
+	int res, frames = 0;
+
+	if (acm_sample_size(wordlen) == 0)
+		return ACM_ERR_BADFMT;
+	if (!acm->mem_data)
+		return ACM_ERR_NOT_SEEKABLE;
+
+	end = acm->total_values;
+	if ((unsigned long long)nframes * chans < end)
+		end = nframes * chans;
+	if (end == 0)
+		return 0;
+
+	nblocks = (end + acm->block_len - 1) / acm->block_len;
+	if (nthreads < 1)
+		nthreads = 1;
+	nseg = nthreads * SEGS_PER_THREAD;
+	if (nseg > nblocks)
+		nseg = nblocks;
+	/* segments must start at frame boundary */
+	if (acm->block_len % chans != 0)
+		nseg = 1;
+
+	/* stale checkpoints would decode garbage, stream is scanned instead */
+	for (i = 0; acm->index != NULL && i < acm->index->count; i++) {
+		if (acm_index_check(acm, i) == 0)
+			acm_index_clear(acm);
+	}
+
+	seg = calloc(nseg, sizeof(*seg));
+	if (seg == NULL)
+		return ACM_ERR_OTHER;
+	res = plan_segments(acm, seg, nseg, nblocks);
+	if (res <= 0) {
+		free(seg);
+		return res < 0 ? res : ACM_ERR_OTHER;
+	}
+	nseg = res;
+	for (i = 0; i < nseg; i++) {
+		seg[i].end = i + 1 < nseg ? seg[i + 1].start : end;
+		seg[i].res = ACM_ERR_OTHER;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.acm = acm;
+	job.dst = dst;
+	job.bigendianp = bigendianp;
+	job.wordlen = wordlen;
+	job.sgned = sgned;
+	job.seg = seg;
+	job.nseg = nseg;
+	run_threads(&job, (unsigned)nthreads < nseg ? nthreads : (int)nseg);
+
+	/* frames until first short segment, same as reading would give */
+	for (i = 0; i < nseg; i++) {
+		if (seg[i].res < 0) {
+			if (frames == 0)
+				frames = seg[i].res;
+			break;
+		}
+		frames += seg[i].res;
+		if ((unsigned)seg[i].res < (seg[i].end - seg[i].start) / chans)
+			break;
+	}
+	free(seg);
+	return frames;
+}
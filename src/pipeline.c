@@ -0,0 +1,263 @@
+/*
+ * Pipelined decoding for libacm.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "libacm.h"
+#include "index.h"
+#include "pipeline.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/* blocks read ahead */
+#define PIPE_SLOTS	4
+
+struct PipeSlot {
+	int *block;
+	unsigned long long bit_ofs, end_ofs;	/* block start and end */
+	int res;			/* from acm_read_block() */
+};
+
+struct ACMPipe {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned started:1;		/* thread needs join */
+	unsigned done:1;		/* thread has exited */
+	unsigned stop:1;		/* thread should exit */
+	unsigned head, count;		/* filled slots */
+	unsigned pos;			/* stream position of next block read */
+	unsigned long long end_ofs;	/* end of last block given to reader */
+	struct PipeSlot slot[PIPE_SLOTS];
+};
+
+static void *pipe_worker(void *arg)
+{
+	ACMStream *acm = arg;
+	struct ACMPipe *pipe = acm->pipe;
+	struct PipeSlot *s;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (!pipe->stop) {
+		if (pipe->count == PIPE_SLOTS) {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+			continue;
+		}
+		s = &pipe->slot[(pipe->head + pipe->count) % PIPE_SLOTS];
+		pthread_mutex_unlock(&pipe->lock);
+
+		/* do not read past last block, reader stops there too */
+		if (pipe->pos >= acm->total_values) {
+			s->bit_ofs = ~0ULL;
+			s->end_ofs = ~0ULL;
+			s->res = 0;
+		} else {
+			s->bit_ofs = acm->file_eof ? ~0ULL : acm_tell_bits(acm);
+			s->res = acm_read_block(acm, s->block);
+			s->end_ofs = acm->file_eof ? ~0ULL : acm_tell_bits(acm);
+			pipe->pos += acm->block_len;
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->count++;
+		pthread_cond_signal(&pipe->cond);
+		/* reader sees EOF or error, and restarts if it wants more */
+		if (s->res <= 0)
+			break;
+	}
+	pipe->done = 1;
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+/* join worker, with lock held */
+static void pipe_join(struct ACMPipe *pipe)
+{
+	if (!pipe->started)
+		return;
+	pipe->stop = 1;
+	pthread_cond_signal(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+	pthread_join(pipe->thread, NULL);
+	pthread_mutex_lock(&pipe->lock);
+	pipe->started = 0;
+	pipe->done = 0;
+	pipe->stop = 0;
+}
+
+int acm_pipe_next(ACMStream *acm, unsigned long long *bit_ofs)
+{
+	struct ACMPipe *pipe = acm->pipe;
+	struct PipeSlot *s;
+	int *tmp, res;
+
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->count == 0 && pipe->done)
+		pipe_join(pipe);
+	if (!pipe->started) {
+		/* worker continues after blocks already in ring */
+		pipe->pos = acm->stream_pos - acm->stream_pos % acm->block_len
+			+ pipe->count * acm->block_len;
+		if (pthread_create(&pipe->thread, NULL, pipe_worker, acm) != 0) {
+			pthread_mutex_unlock(&pipe->lock);
+			return ACM_ERR_OTHER;
+		}
+		pipe->started = 1;
+	}
+	while (pipe->count == 0)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+	s = &pipe->slot[pipe->head];
+	tmp = acm->block;
+	acm->block = s->block;
+	s->block = tmp;
+	*bit_ofs = s->bit_ofs;
+	pipe->end_ofs = s->end_ofs;
+	res = s->res;
+
+	pipe->head = (pipe->head + 1) % PIPE_SLOTS;
+	pipe->count--;
+	pthread_cond_signal(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+	return res;
+}
+
+void acm_pipe_stop(ACMStream *acm, int drop)
+{
+	struct ACMPipe *pipe = acm->pipe;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe_join(pipe);
+	if (drop)
+		pipe->count = 0;
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+int acm_pipe_tell(ACMStream *acm, unsigned long long *bit_ofs)
+{
+	struct ACMPipe *pipe = acm->pipe;
+
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->count > 0)
+		*bit_ofs = pipe->slot[pipe->head].bit_ofs;
+	else if (pipe->started)
+		*bit_ofs = pipe->end_ofs;
+	else
+		*bit_ofs = ~0ULL;
+	pthread_mutex_unlock(&pipe->lock);
+
+	/* unknown after EOF, worker does not use reader anymore then */
+	return *bit_ofs != ~0ULL;
+}
+
+void acm_pipe_free(ACMStream *acm)
+{
+	struct ACMPipe *pipe = acm->pipe;
+	unsigned i;
+
+	if (pipe == NULL)
+		return;
+	acm_pipe_stop(acm, 1);
+	for (i = 0; i < PIPE_SLOTS; i++)
+		free(pipe->slot[i].block);
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe);
+	acm->pipe = NULL;
+}
+
+static int pipe_new(ACMStream *acm)
+{
+	struct ACMPipe *pipe;
+	unsigned i;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (pipe == NULL)
+		return ACM_ERR_OTHER;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	acm->pipe = pipe;
+
+	for (i = 0; i < PIPE_SLOTS; i++) {
+		pipe->slot[i].block = malloc(acm->block_len * sizeof(int));
+		if (pipe->slot[i].block == NULL) {
+			acm_pipe_free(acm);
+			return ACM_ERR_OTHER;
+		}
+	}
+	return ACM_OK;
+}
+
+int acm_set_pipeline(ACMStream *acm, int enable)
+{
+	struct ACMPipe *pipe = acm->pipe;
+	unsigned long long ofs;
+
+	if (enable)
+		return pipe ? ACM_OK : pipe_new(acm);
+	if (pipe == NULL)
+		return ACM_OK;
+
+	/* bit reader is ahead of blocks still in ring, go back */
+	acm_pipe_stop(acm, 0);
+	if (pipe->count > 0 && pipe->slot[pipe->head].bit_ofs != ~0ULL) {
+		ofs = pipe->slot[pipe->head].bit_ofs;
+		if (!acm->mem_data && acm->io.seek_func == NULL)
+			return ACM_ERR_NOT_SEEKABLE;
+		acm_pipe_free(acm);
+		return acm_seek_bits(acm, ofs);
+	}
+	acm_pipe_free(acm);
+	return ACM_OK;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+int acm_pipe_next(ACMStream *acm, unsigned long long *bit_ofs)
+{
+	return ACM_ERR_OTHER;
+}
+
+void acm_pipe_stop(ACMStream *acm, int drop)
+{
+}
+
+int acm_pipe_tell(ACMStream *acm, unsigned long long *bit_ofs)
+{
+	return 0;
+}
+
+void acm_pipe_free(ACMStream *acm)
+{
+}
+
+int acm_set_pipeline(ACMStream *acm, int enable)
+{
+	return enable ? ACM_ERR_OTHER : ACM_OK;
+}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,51 @@
+/*
+ * Pipelined decoding for libacm, internal API.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ACM_PIPELINE_H
+#define __ACM_PIPELINE_H
+
+/*
+ * Worker thread reads blocks ahead into a ring of buffers,
+ * reading thread juggles and converts them.  While worker runs,
+ * it owns the bit reader and colbuf, reading thread owns the rest.
+ */
+
+/*
+ * Next block from worker, its buffer is swapped with acm->block.
+ * Starts worker if needed.  "bit_ofs" is set to block start,
+ * or ~0 if unknown.  returns 1, 0 on EOF or ACM_ERR_*
+ */
+int acm_pipe_next(ACMStream *acm, unsigned long long *bit_ofs);
+
+/*
+ * Stop worker, so bit reader can be used directly.  Blocks read ahead
+ * are kept for acm_pipe_next(), unless "drop" is set.
+ */
+void acm_pipe_stop(ACMStream *acm, int drop);
+
+/*
+ * Bit position after blocks given to reader, blocks read ahead are
+ * not counted.  Worker keeps running.  returns 0 if position is not
+ * known, then worker is not using the bit reader and it can be asked.
+ */
+int acm_pipe_tell(ACMStream *acm, unsigned long long *bit_ofs);
+
+/* stop worker and free pipeline */
+void acm_pipe_free(ACMStream *acm);
+
+#endif
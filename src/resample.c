@@ -0,0 +1,300 @@
+/*
+ * Polyphase resampler for libacm output stage.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "libacm.h"
+#include "resample.h"
+
+/* input frames buffered between pulls */
+#define RS_FRAMES	1024
+
+/* filter half-width in input samples, when not downsampling */
+#define RS_HALF		8
+
+/* limits for rate ratio */
+#define RS_MAX_PHASES	4096
+#define RS_MAX_DOWN	16
+
+struct ACMResampler {
+	unsigned chans;
+	unsigned up, down;		/* out_rate / in_rate == up / down */
+	unsigned taps, half;		/* filter length for each phase */
+	float *coef;			/* "taps" values for each of "up" phases */
+	float *coef2;			/* coef with each value twice, for stereo */
+	float *hist;			/* input frames, channels interleaved */
+	unsigned hist_max, hist_len;	/* in frames */
+	unsigned pos, phase;		/* next output is at hist[pos + phase/up] */
+	unsigned long long in_count, out_count;
+	int flushed;
+	int simd;
+};
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Blackman-windowed sinc, cut at lower Nyquist frequency.
+ * Each phase is normalized to unity gain.
+ */
+static void make_filter(struct ACMResampler *rs)
+{
+	double cut = rs->up < rs->down ? (double)rs->up / rs->down : 1.0;
+	double d, x, h, sum;
+	unsigned p, k;
+
+	for (p = 0; p < rs->up; p++) {
+		float *c = rs->coef + p * rs->taps;
+		sum = 0;
+		for (k = 0; k < rs->taps; k++) {
+			/* distance from output position to input sample k */
+			d = (double)p / rs->up + rs->half - 1 - k;
+			x = M_PI * cut * d;
+			h = (x == 0) ? 1.0 : sin(x) / x;
+			x = M_PI * d / rs->half;
+			h *= 0.42 + 0.5 * cos(x) + 0.08 * cos(2 * x);
+			c[k] = h;
+			sum += h;
+		}
+		for (k = 0; k < rs->taps; k++)
+			c[k] /= sum;
+	}
+	if (rs->coef2) {
+		for (k = 0; k < rs->up * rs->taps; k++)
+			rs->coef2[k*2] = rs->coef2[k*2 + 1] = rs->coef[k];
+	}
+}
+
+struct ACMResampler *acm_resampler_new(unsigned chans, unsigned in_rate,
+				       unsigned out_rate, int simd)
+{
+	struct ACMResampler *rs;
+	unsigned g, half;
+
+	if (chans == 0 || in_rate == 0 || out_rate == 0)
+		return NULL;
+	g = gcd(in_rate, out_rate);
+	if (out_rate / g > RS_MAX_PHASES || in_rate / g > RS_MAX_DOWN * (out_rate / g))
+		return NULL;
+
+	rs = calloc(1, sizeof(*rs));
+	if (rs == NULL)
+		return NULL;
+	rs->chans = chans;
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+	rs->simd = simd;
+
+	/* wider filter for lower cutoff, taps multiple of 4 */
+	half = RS_HALF;
+	if (rs->down > rs->up)
+		half = (RS_HALF * rs->down + rs->up - 1) / rs->up;
+	rs->half = (half + 1) & ~1U;
+	rs->taps = rs->half * 2;
+
+	rs->hist_max = rs->taps * 2 + RS_FRAMES;
+	rs->coef = malloc(rs->up * rs->taps * sizeof(float));
+	rs->hist = malloc(rs->hist_max * chans * sizeof(float));
+	if (rs->coef == NULL || rs->hist == NULL) {
+		acm_resampler_free(rs);
+		return NULL;
+	}
+	if (chans == 2 && simd >= ACM_SIMD_SSE2) {
+		rs->coef2 = malloc(rs->up * rs->taps * 2 * sizeof(float));
+		if (rs->coef2 == NULL)
+			rs->simd = ACM_SIMD_NONE;
+	}
+	make_filter(rs);
+	acm_resampler_reset(rs);
+	return rs;
+}
+
+void acm_resampler_free(struct ACMResampler *rs)
+{
+	if (rs == NULL)
+		return;
+	free(rs->coef);
+	free(rs->coef2);
+	free(rs->hist);
+	free(rs);
+}
+
+void acm_resampler_reset(struct ACMResampler *rs)
+{
+	/* zeros before first sample, so first output is at sample 0 */
+	rs->hist_len = rs->half - 1;
+	memset(rs->hist, 0, rs->hist_len * rs->chans * sizeof(float));
+	rs->pos = 0;
+	rs->phase = 0;
+	rs->in_count = 0;
+	rs->out_count = 0;
+	rs->flushed = 0;
+}
+
+unsigned acm_resampler_push(struct ACMResampler *rs, const int *src, unsigned nframes)
+{
+	unsigned i, n = rs->hist_max - rs->hist_len;
+	float *dst = rs->hist + rs->hist_len * rs->chans;
+
+	if (rs->flushed)
+		return 0;
+	if (n > nframes)
+		n = nframes;
+
+	for (i = 0; i < n * rs->chans; i++)
+		dst[i] = src[i];
+	rs->hist_len += n;
+	rs->in_count += n;
+	return n;
+}
+
+int acm_resampler_flush(struct ACMResampler *rs)
+{
+	unsigned n = rs->half;
+
+	if (rs->flushed)
+		return 0;
+	/* zeros after last sample, for filter tail */
+	if (n > rs->hist_max - rs->hist_len)
+		n = rs->hist_max - rs->hist_len;
+	memset(rs->hist + rs->hist_len * rs->chans, 0, n * rs->chans * sizeof(float));
+	rs->hist_len += n;
+	rs->flushed = 1;
+	return 1;
+}
+
+/* round to nearest, values out of int range are clamped */
+static inline int to_int(float v)
+{
+	if (v >= 2147483520.0f)
+		return 0x7FFFFFFF;
+	if (v <= -2147483648.0f)
+		return -0x7FFFFFFF - 1;
+	return v < 0 ? (int)(v - 0.5f) : (int)(v + 0.5f);
+}
+
+/* one output frame, any number of channels */
+static void filter_frame(struct ACMResampler *rs, int *dst)
+{
+	const float *coef = rs->coef + rs->phase * rs->taps;
+	const float *h;
+	unsigned c, k, chans = rs->chans;
+	float sum;
+
+	for (c = 0; c < chans; c++) {
+		h = rs->hist + rs->pos * chans + c;
+		sum = 0;
+		for (k = 0; k < rs->taps; k++)
+			sum += coef[k] * h[k * chans];
+		dst[c] = to_int(sum);
+	}
+}
+
+#ifdef __SSE2__
+
+static inline __m128i round_sse2(__m128 v)
+{
+	v = _mm_min_ps(v, _mm_set1_ps(2147483520.0f));
+	v = _mm_max_ps(v, _mm_set1_ps(-2147483648.0f));
+	return _mm_cvtps_epi32(v);
+}
+
+/* mono, 4 taps per vector */
+static void filter_mono_sse2(struct ACMResampler *rs, int *dst)
+{
+	const float *coef = rs->coef + rs->phase * rs->taps;
+	const float *h = rs->hist + rs->pos;
+	__m128 s = _mm_setzero_ps();
+	unsigned k;
+
+	for (k = 0; k < rs->taps; k += 4)
+		s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(coef + k), _mm_loadu_ps(h + k)));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	*dst = _mm_cvtsi128_si32(round_sse2(s));
+}
+
+/* stereo, 2 frames per vector, left sums in even lanes */
+static void filter_stereo_sse2(struct ACMResampler *rs, int *dst)
+{
+	const float *coef = rs->coef2 + rs->phase * rs->taps * 2;
+	const float *h = rs->hist + rs->pos * 2;
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	unsigned k;
+
+	for (k = 0; k < rs->taps * 2; k += 8) {
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(coef + k), _mm_loadu_ps(h + k)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(coef + k + 4), _mm_loadu_ps(h + k + 4)));
+	}
+	s0 = _mm_add_ps(s0, s1);
+	s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+	_mm_storel_epi64((__m128i *)dst, round_sse2(s0));
+}
+
+#endif
+
+unsigned acm_resampler_pull(struct ACMResampler *rs, int *dst, unsigned maxframes)
+{
+	void (*filter)(struct ACMResampler *rs, int *dst) = filter_frame;
+	unsigned n = 0;
+
+#ifdef __SSE2__
+	if (rs->simd >= ACM_SIMD_SSE2 && rs->chans == 1)
+		filter = filter_mono_sse2;
+	else if (rs->simd >= ACM_SIMD_SSE2 && rs->chans == 2)
+		filter = filter_stereo_sse2;
+#endif
+
+	while (n < maxframes && rs->pos + rs->taps <= rs->hist_len
+	       && rs->out_count * rs->down < rs->in_count * rs->up)
+	{
+		filter(rs, dst);
+		dst += rs->chans;
+		n++;
+		rs->out_count++;
+		rs->phase += rs->down;
+		rs->pos += rs->phase / rs->up;
+		rs->phase %= rs->up;
+	}
+
+	/* drop used input */
+	if (rs->pos > 0) {
+		memmove(rs->hist, rs->hist + rs->pos * rs->chans,
+			(rs->hist_len - rs->pos) * rs->chans * sizeof(float));
+		rs->hist_len -= rs->pos;
+		rs->pos = 0;
+	}
+	return n;
+}
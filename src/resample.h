@@ -0,0 +1,48 @@
+/*
+ * Polyphase resampler for libacm output stage.
+ *
+ * Copyright (c) 2004-2010, Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ACM_RESAMPLE_H
+#define __ACM_RESAMPLE_H
+
+/*
+ * Resampler works on interleaved int frames, values keep the scale
+ * of the input.  Output is aligned with input, the filter delay is
+ * compensated, and after acm_resampler_flush() exactly
+ * ceil(input_frames * out_rate / in_rate) frames are returned.
+ */
+
+struct ACMResampler;
+
+/* returns NULL if rates are not supported or out of memory */
+struct ACMResampler *acm_resampler_new(unsigned chans, unsigned in_rate,
+				       unsigned out_rate, int simd);
+void acm_resampler_free(struct ACMResampler *rs);
+
+/* forget all input, start from beginning */
+void acm_resampler_reset(struct ACMResampler *rs);
+
+/* add input frames, returns number of frames taken */
+unsigned acm_resampler_push(struct ACMResampler *rs, const int *src, unsigned nframes);
+
+/* mark end of input, returns 0 if already done */
+int acm_resampler_flush(struct ACMResampler *rs);
+
+/* get up to "maxframes" output frames, 0 means more input is needed */
+unsigned acm_resampler_pull(struct ACMResampler *rs, int *dst, unsigned maxframes);
+
+#endif
@@ -21,9 +21,20 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "libacm.h"
+#include "index.h"
+#include "pipeline.h"
 
 #define WAVC_HEADER_LEN	28
 #define ACM_HEADER_LEN	14
@@ -90,6 +101,89 @@ static int _get_length_file(void *arg)
 	return len;
 }
 
+#ifdef HAVE_SYS_MMAN_H
+
+/*
+ * File IO using mmap, decoder reads directly from mapped pages.
+ */
+
+struct MapFile {
+	void *ptr;
+	size_t len;
+};
+
+static int _close_map(void *arg)
+{
+	struct MapFile *map = arg;
+	int res = munmap(map->ptr, map->len);
+	free(map);
+	return res;
+}
+
+/* returns 1 if file was mapped, 0 if caller should try stdio */
+static int open_map(ACMStream **res, const char *filename, int force_chans, int *err_p)
+{
+	int fd, err;
+	struct stat st;
+	struct MapFile *map;
+	ACMStream *acm;
+	void *ptr;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return 0;
+	/* pipes and special files go through stdio */
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+	    || st.st_size <= 0 || st.st_size > 0x7FFFFFFF) {
+		close(fd);
+		return 0;
+	}
+	/* private, so changes to the file are not meant to be seen */
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return 0;
+#ifdef HAVE_MADVISE
+	madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+	madvise(ptr, st.st_size, MADV_WILLNEED);
+#endif
+
+	map = malloc(sizeof(*map));
+	if (!map) {
+		munmap(ptr, st.st_size);
+		*err_p = ACM_ERR_OTHER;
+		return 1;
+	}
+	map->ptr = ptr;
+	map->len = st.st_size;
+
+	if ((err = acm_open_memory(&acm, ptr, st.st_size, force_chans)) < 0) {
+		_close_map(map);
+		*err_p = err;
+		return 1;
+	}
+	acm->io_arg = map;
+	acm->io.close_func = _close_map;
+
+	*res = acm;
+	*err_p = ACM_OK;
+	return 1;
+}
+
+#endif /* HAVE_SYS_MMAN_H */
+
+/* pick up seek index written by acm_index_save(), if there is one */
+static void load_sidecar(ACMStream *acm, const char *filename)
+{
+	char *fn = malloc(strlen(filename) + strlen(ACM_INDEX_SUFFIX) + 1);
+
+	if (fn == NULL)
+		return;
+	strcpy(fn, filename);
+	strcat(fn, ACM_INDEX_SUFFIX);
+	acm_index_load(acm, fn);
+	free(fn);
+}
+
 int acm_open_file(ACMStream **res, const char *filename, int force_chans)
 {
 	int err;
@@ -97,6 +191,14 @@ int acm_open_file(ACMStream **res, const char *filename, int force_chans)
 	acm_io_callbacks io;
 	ACMStream *acm;
 
+#ifdef HAVE_SYS_MMAN_H
+	if (open_map(res, filename, force_chans, &err)) {
+		if (err == ACM_OK)
+			load_sidecar(*res, filename);
+		return err;
+	}
+#endif
+
 	if ((f = fopen(filename, "rb")) == NULL)
        		return ACM_ERR_OPEN;
 
@@ -110,6 +212,7 @@ int acm_open_file(ACMStream **res, const char *filename, int force_chans)
 		fclose(f);
 		return err;
 	}
+	load_sidecar(acm, filename);
 	*res = acm;
 	return 0;
 }
@@ -191,6 +294,11 @@ unsigned acm_time_total(ACMStream *acm)
 
 unsigned acm_raw_tell(ACMStream *acm)
 {
+	unsigned long long ofs;
+
+	/* reader position belongs to the worker while it runs */
+	if (acm->pipe && acm_pipe_tell(acm, &ofs))
+		return ofs >> 3;
 	return acm->buf_start_ofs + acm->buf_pos;
 }
 
@@ -215,28 +323,24 @@ int acm_seek_pcm(ACMStream *acm, unsigned pcm_pos)
 {
 	unsigned word_pos = pcm_pos * acm->info.channels;
 	unsigned start_ofs;
+	int res;
 
-	if (word_pos < acm->stream_pos) {
-		if (acm->io.seek_func == NULL)
-			return ACM_ERR_NOT_SEEKABLE;
+	/* nearest checkpoint, if index is built */
+	res = acm_index_seek(acm, word_pos);
+	if (res < 0)
+		return res;
 
+	if (res == 0 && word_pos < acm->stream_pos) {
 		start_ofs = ACM_HEADER_LEN;
 		if (acm->wavc_file)
 			start_ofs += WAVC_HEADER_LEN;
 
-		if (acm->io.seek_func(acm->io_arg, start_ofs, SEEK_SET) < 0)
-			return ACM_ERR_NOT_SEEKABLE;
-	
-		acm->file_eof = 0;
-		acm->buf_pos = 0;
- 		acm->buf_size = 0;
-		acm->bit_avail = 0;
-		acm->bit_data = 0;
+		if ((res = acm_seek_bits(acm, start_ofs * 8)) < 0)
+			return res;
 
 		acm->stream_pos = 0;
 		acm->block_pos = 0;
 		acm->block_ready = 0;
-		acm->buf_start_ofs = ACM_HEADER_LEN;
 
 		memset(acm->wrapbuf, 0, acm->wrapbuf_len * sizeof(int));
 	}